@@ -20,6 +20,6 @@ struct apu_state {
 	uint8_t tout[3];
 };
 
-struct apu_state apu_state_from_aram(const uint8_t aram[static 0x10000]);
+struct apu_state apu_state_from_aram(const uint8_t ram[static 0x10000]);
 void apu_restore(const struct apu_state st);
 void apu_reset(void);
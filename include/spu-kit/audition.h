@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* one note on one voice, times are in frames at DSP_HZ */
+struct audition_voice {
+	uint8_t srcn;
+	uint16_t pitch;
+	uint8_t adsr1;
+	uint8_t adsr2;
+	uint8_t gain;
+	int8_t voll;
+	int8_t volr;
+	/* through the echo, as the snapshot has it set up */
+	bool echo;
+	unsigned long on;
+	unsigned long off;
+};
+
+/* Play up to 8 notes, one per voice starting from voice 0, out of the samples
+ * in ram, with the DSP set up as in dsp_regs and no CPU involved. None of what
+ * the driver had playing is heard, its echo included: echo is off unless a
+ * note asks for it, and then starts from a silent buffer. Renders until a
+ * little after the last key-off, and dsp_finish()es.
+ */
+bool audition_run(unsigned int nr;
+		const uint8_t ram[static 0x10000],
+		const uint8_t dsp_regs[static 0x80],
+		const struct audition_voice voices[static nr],
+		unsigned int nr);
@@ -8,11 +8,20 @@ typedef struct bufwr bufwr_t;
 
 bufwr_t *bufwr_new(const int fd, const size_t buf_size);
 
+/* Hand filled buffers to a thread of their own to write out, from a pool of
+ * nr_bufs, so that the caller only waits on the fd when they're all in flight.
+ * Write errors show up in whichever bufwr_write(), bufwr_flush() or
+ * bufwr_close() comes next. On failure, carries on writing synchronously.
+ */
+__attribute__((warn_unused_result))
+bool bufwr_async(bufwr_t *f, const unsigned int nr_bufs);
+
 __attribute__((warn_unused_result))
 bool bufwr_write(bufwr_t *f,
 		const void * const buf,
 		const size_t len);
 
+/* returns once everything so far is written, or has failed to be */
 __attribute__((warn_unused_result))
 bool bufwr_flush(bufwr_t *f);
 
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* Record everything the CPU does that the DSP can see in to fn: the DSP
+ * registers and ARAM as they were at dsp_restore() or dsp_reset(), then every
+ * DSP register store and every ARAM store to a page the DSP reads, each at the
+ * DSP clock it happened on. Must be set before dsp_restore() or dsp_reset().
+ */
+void dsp_log_record(const char *fn);
+
+/* Render from a log made by dsp_log_record() with the DSP alone, in place of
+ * the CPU, and dsp_finish() it. With log_length, for as long as the recording,
+ * and with log_fade, with the same fade, otherwise as dsp_set_length() and
+ * dsp_set_fade() say.
+ */
+bool dsp_log_replay(const char *fn,
+			const bool log_length,
+			const bool log_fade);
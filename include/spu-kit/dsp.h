@@ -1,7 +1,99 @@
 #pragma once
 
+#include <spu-kit/resample.h>
+#include <spu-kit/sink.h>
+
+#include <stdbool.h>
 #include <stdint.h>
 
+/* native output rate */
+#define DSP_HZ 32000
+
+typedef enum {
+	/* bit-exact 4-tap gaussian, one voice at a time */
+	DSP_INTERP_GAUSS,
+	/* bit-exact 4-tap gaussian, all voices at once */
+	DSP_INTERP_GAUSS_SIMD,
+	/* 2-tap linear, for previews */
+	DSP_INTERP_LINEAR,
+	/* nearest sample, for analysis */
+	DSP_INTERP_NONE,
+} dsp_interp_t;
+
+typedef enum {
+	/* a whole sample at a time, as fast as possible */
+	DSP_TIER_FAST,
+	/* each sample in two halves, one at each 16 cycle clock: voices 0-4
+	 * then the rest, so the later voices see register writes made
+	 * between the two. Not cycle accurate, every voice in a half sees the
+	 * same registers.
+	 */
+	DSP_TIER_HALVES,
+	/* linear interpolation and no echo, for quick listening */
+	DSP_TIER_PREVIEW,
+} dsp_tier_t;
+
+/* one stereo stem for each voice, then one for the echo return */
+#define DSP_STEMS 9
+
+typedef enum {
+	/* just the mix, to out.wav */
+	DSP_STEMS_OFF,
+	/* all the stems in one multi-channel stems.wav */
+	DSP_STEMS_MULTI,
+	/* stem-0.wav to stem-7.wav, and stem-echo.wav */
+	DSP_STEMS_SPLIT,
+} dsp_stems_t;
+
 void dsp_restore(const uint8_t saved[static 0x80]);
 
 void dsp_reset(void);
+
+/* Once whatever was clocking the DSP has stopped, close the output and, when
+ * pipelined, wait for the DSP thread. Returns false if anything went wrong.
+ */
+__attribute__((warn_unused_result))
+bool dsp_finish(void);
+
+void dsp_set_interp(const dsp_interp_t mode);
+
+/* Resample the output to rate Hz, or 0 for DSP_HZ */
+void dsp_set_output_rate(const unsigned int rate,
+			const resample_quality_t quality);
+
+/* Where the output goes, each rendered block being written to all nr of them
+ * at once, as sink_new_tee() does. fd is only used by SINK_RAW. The default is
+ * .wav files.
+ */
+void dsp_set_sinks(unsigned int nr;
+			const sink_type_t type[static nr],
+			unsigned int nr,
+			const int fd);
+
+/* Name output files name.wav, name.stems.wav and so on, instead of out.wav,
+ * stems.wav etc.
+ */
+void dsp_set_output_name(const char *name);
+
+/* Play for frames frames at DSP_HZ before any fade, 0 for the fade alone.
+ * A minute if it's never set.
+ */
+void dsp_set_length(const unsigned long frames);
+
+/* Then fade out over this many more, none by default */
+void dsp_set_fade(const unsigned long frames);
+
+/* Output each voice and the echo return separately instead of the mix */
+void dsp_set_stems(const dsp_stems_t mode);
+
+/* Silence the voices with their bit set, skipping as much of their work as
+ * possible while keeping what the CPU can see of them going.
+ */
+void dsp_set_mute(const uint8_t mask);
+
+void dsp_set_tier(const dsp_tier_t tier);
+
+/* Run the DSP on its own thread, behind the CPU. Must be set before
+ * dsp_restore() or dsp_reset().
+ */
+void dsp_set_pipelined(const bool on);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct flac_s;
+typedef struct flac_s flac_t;
+
+/* A 16-bit FLAC file of up to 8 channels, encoded on a thread of its own as
+ * blocks of samples fill up.
+ */
+flac_t *flac_create(const char *fn,
+			const unsigned int rate,
+			const unsigned int channels);
+
+/* Write errors from the encoder thread show up in the next call, or close */
+__attribute__((nonnull(1),warn_unused_result))
+bool flac_write_samples16(size_t num;
+		flac_t *flac,
+		const int16_t sample[static num],
+		size_t num);
+
+__attribute__((nonnull(1),warn_unused_result))
+bool _flac_close(flac_t *flac);
+
+__attribute__((warn_unused_result))
+static inline bool flac_close(flac_t *flac)
+{
+	if (flac == NULL) {
+		return true;
+	}
+	return _flac_close(flac);
+}
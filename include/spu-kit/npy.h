@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct npy_s;
+typedef struct npy_s npy_t;
+
+typedef enum {
+	/* scaled to [-1, 1) */
+	NPY_FLOAT32,
+	NPY_INT16,
+} npy_dtype_t;
+
+struct npy_format {
+	npy_dtype_t dtype;
+	/* each channel's samples together, rather than frame by frame */
+	bool planar;
+	/* cut in to windows of this many milliseconds, dropping whatever's
+	 * left over at the end, 0 for one long array
+	 */
+	unsigned long window_ms;
+};
+
+/* A NumPy .npy array of shape (frames, channels), or (channels, frames) if
+ * planar, with windows adding a leading dimension. The shape is patched in
+ * on close. Planar without windows keeps every sample in memory until then.
+ */
+__attribute__((nonnull(1,4)))
+npy_t *npy_create(const char *fn,
+			const unsigned int rate,
+			const unsigned int channels,
+			const struct npy_format *fmt);
+
+__attribute__((nonnull(1),warn_unused_result))
+bool npy_write_samples16(size_t num;
+		npy_t *npy,
+		const int16_t sample[static num],
+		size_t num);
+
+__attribute__((nonnull(1),warn_unused_result))
+bool _npy_close(npy_t *npy);
+
+__attribute__((warn_unused_result))
+static inline bool npy_close(npy_t *npy)
+{
+	if (npy == NULL) {
+		return true;
+	}
+	return _npy_close(npy);
+}
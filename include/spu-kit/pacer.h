@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <spu-kit/sink.h>
+
+struct pacer_s;
+typedef struct pacer_s pacer_t;
+
+/* Hands what's written to out a period of frames at a time, each when it
+ * would be played at rate in real time, from a queue of up to nr_periods of
+ * them. Playing starts once the queue first fills. A period that isn't ready
+ * in time is an underrun, and goes out as soon as it is. On close, says how
+ * long each period took to render, as a histogram, how many underruns there
+ * were, and how close to one it came. out is closed with it, but is left to
+ * the caller if this fails.
+ *
+ * The DSP hands over 256 frames at a time, more when resampling up, so a
+ * queue shorter than that underruns however quick rendering is.
+ */
+__attribute__((nonnull(1,2)))
+pacer_t *pacer_new(sink_t *out,
+			const char *name,
+			const unsigned int rate,
+			const unsigned int channels,
+			const unsigned int period,
+			const unsigned int nr_periods);
+
+/* Waits for room in the queue. Write errors from out show up here, or close. */
+__attribute__((nonnull(1),warn_unused_result))
+bool pacer_write_samples16(size_t num;
+		pacer_t *p,
+		const int16_t sample[static num],
+		size_t num);
+
+__attribute__((nonnull(1),warn_unused_result))
+bool _pacer_close(pacer_t *p);
+
+__attribute__((warn_unused_result))
+static inline bool pacer_close(pacer_t *p)
+{
+	if (p == NULL) {
+		return true;
+	}
+	return _pacer_close(p);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct resample_s;
+typedef struct resample_s resample_t;
+
+typedef enum {
+	/* 8 taps per phase, least latency */
+	RESAMPLE_FAST,
+	/* 16 taps per phase */
+	RESAMPLE_MEDIUM,
+	/* 32 taps per phase, flattest passband and deepest stopband */
+	RESAMPLE_BEST,
+} resample_quality_t;
+
+/* Streaming polyphase FIR conversion of interleaved 16-bit stereo from
+ * in_rate to out_rate, by whatever rational factor relates the two.
+ */
+resample_t *resample_new(const unsigned int in_rate,
+			const unsigned int out_rate,
+			const resample_quality_t quality);
+
+/* The most frames resample_run() can produce from nr input frames */
+__attribute__((pure,nonnull(1)))
+size_t resample_max_out(const resample_t *r, const size_t nr);
+
+/* Consume nr input frames, returns how many frames were written to out */
+__attribute__((nonnull(1,2,4)))
+size_t resample_run(size_t nr;
+			resample_t *r,
+			const int16_t in[static nr * 2],
+			size_t nr,
+			int16_t *out);
+
+/* At the end of the stream, push silence through to get out what's left in
+ * the filter, never more than resample_max_out(r, 16) frames.  Together with
+ * the delay resample_run() leaves off the start, the output is exactly as
+ * long as it would have been and lines up with the input.
+ */
+__attribute__((nonnull))
+size_t resample_flush(resample_t *r, int16_t *out);
+
+void resample_free(resample_t *r);
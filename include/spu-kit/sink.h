@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <spu-kit/npy.h>
+
+typedef enum {
+	/* a .wav file */
+	SINK_WAV,
+	/* a .flac file, encoded on a thread of its own */
+	SINK_FLAC,
+	/* a NumPy .npy array, as sink_set_npy() says */
+	SINK_NPY,
+	/* headerless 16-bit little-endian PCM down a file descriptor, which is
+	 * never seeked, so it can be a pipe
+	 */
+	SINK_RAW,
+	/* loudness and peak statistics, said on close */
+	SINK_STATS,
+	/* nowhere, for benchmarking */
+	SINK_NULL,
+} sink_type_t;
+
+/* how many sink types there are, so the most a tee can have */
+#define SINK_NR		(SINK_NULL + 1)
+
+struct sink_s;
+typedef struct sink_s sink_t;
+
+/* How SINK_NPY files are laid out, float32 and interleaved by default */
+void sink_set_npy(const struct npy_format *fmt);
+
+/* Pace everything sink_new_tee() opens from now on to real time, as pacer.h
+ * says, in periods of period frames with up to nr_periods of them queued. 0
+ * for as fast as it'll go, the default.
+ */
+void sink_set_realtime(const unsigned int period,
+			const unsigned int nr_periods);
+
+/* Open somewhere to write interleaved 16-bit samples. Files are named name
+ * with the type's extension, and SINK_STATS tags what it says with it. fd is
+ * only used by SINK_RAW, which leaves it open when it's done.
+ */
+sink_t *sink_new(const sink_type_t type,
+		const char *name,
+		const int fd,
+		const unsigned int rate,
+		const unsigned int channels);
+
+/* Everything written goes to each of nr sinks, of different types. With more
+ * than one, each gets a thread of its own and a queue of a couple of seconds,
+ * so one that's slow for a while doesn't hold up the rest. One that's slower
+ * than rendering throughout still sets the pace once its queue is full. Paced
+ * to real time if sink_set_realtime() says so.
+ */
+sink_t *sink_new_tee(unsigned int nr;
+		const sink_type_t type[static nr],
+		unsigned int nr,
+		const char *name,
+		const int fd,
+		const unsigned int rate,
+		const unsigned int channels);
+
+__attribute__((nonnull(1),warn_unused_result))
+bool sink_write(size_t num;
+		sink_t *s,
+		const int16_t sample[static num],
+		size_t num);
+
+/* Get what's been written so far on its way now, rather than when a buffer
+ * fills. Not for paced sinks, which do this themselves.
+ */
+__attribute__((nonnull(1),warn_unused_result))
+bool sink_flush(sink_t *s);
+
+/* flush, close and free, NULL is fine */
+__attribute__((warn_unused_result))
+bool sink_close(sink_t *s);
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define SPC_FORMAT_ID "SNES-SPC700 Sound File Data v0.30"
@@ -75,3 +77,29 @@ struct spc_file {
 } __attribute__((packed));
 
 static_assert(sizeof(struct spc_file) == 0x10200, "Wrong size SPC File");
+
+/* The extended ID666 chunk, if there is one, comes straight after */
+#define SPC_XID6_ID			"xid6"
+
+/* xid6 times are in 1/64000ths of a second */
+#define SPC_TICKS_HZ			64000
+
+struct spc_length {
+	/* how long to play for, then how long to fade out over, in ticks */
+	unsigned long play;
+	unsigned long fade;
+};
+
+/* The tag doesn't say which form it's in, text or binary, so guess from the
+ * length fields.
+ */
+__attribute__((pure,nonnull(1)))
+bool id666_is_text(const struct spc_id666_txt *txt);
+
+/* What the ID666 tag, and the xid6 chunk if there's one in the len bytes
+ * following the SPC, say about the length. Zero for anything they don't.
+ */
+__attribute__((pure,nonnull(1)))
+struct spc_length spc_length(const struct spc_file *spc,
+				const uint8_t *xid6,
+				const size_t len);
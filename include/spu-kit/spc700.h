@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
 struct spc700_regs {
 	uint16_t pc;
@@ -16,4 +17,14 @@ void spc700_restore(const struct spc700_regs r,
 			const uint8_t in[static 0x10000],
 			const uint8_t extra[static 0x40]);
 
-void spc700_run_forever(void);
+/* As spc700_restore(), with the RAM from the whole SPC file open on fd, mapped
+ * copy-on-write rather than copied in, so pages the CPU never writes are never
+ * copied at all. Must come before anything else touches ARAM. False if it
+ * can't be, in which case use spc700_restore().
+ */
+bool spc700_restore_file(const struct spc700_regs r,
+			const int fd,
+			const uint8_t extra[static 0x40]);
+
+/* until the DSP is done rendering, or the CPU halts */
+void spc700_run(void);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct stats_s;
+typedef struct stats_s stats_t;
+
+/* Measures what's written to it and says so on close, tagged with name: the
+ * sample peak, RMS and how many samples hit full scale, and the integrated
+ * loudness as ITU-R BS.1770 has it, K-weighted and gated, with every channel
+ * counting the same.
+ */
+__attribute__((nonnull(1)))
+stats_t *stats_new(const char *name,
+			const unsigned int rate,
+			const unsigned int channels);
+
+__attribute__((nonnull(1)))
+void stats_write_samples16(size_t num;
+		stats_t *st,
+		const int16_t sample[static num],
+		size_t num);
+
+__attribute__((nonnull(1)))
+void _stats_close(stats_t *st);
+
+static inline void stats_close(stats_t *st)
+{
+	if (st == NULL) {
+		return;
+	}
+	_stats_close(st);
+}
@@ -7,7 +7,10 @@
 struct wav_s;
 typedef struct wav_s wav_t;
 
-wav_t *wav_create(const char *fn);
+/* Files which outgrow RIFF's 4 GiB are written as RF64 */
+wav_t *wav_create(const char *fn,
+			const unsigned int rate,
+			const unsigned int channels);
 
 __attribute__((nonnull(1)))
 bool wav_write_samples16(size_t num;
@@ -43,9 +43,9 @@ static uint8_t io_out[4];
 static struct timer T[3];
 
 __attribute__((pure))
-struct apu_state apu_state_from_aram(const uint8_t aram[static 0x10000])
+struct apu_state apu_state_from_aram(const uint8_t ram[static 0x10000])
 {
-	return *((struct apu_state *)(aram + APU_MMIO_BASE));
+	return *((struct apu_state *)(ram + APU_MMIO_BASE));
 }
 
 static inline void dump_apu_state(void)
@@ -292,6 +292,8 @@ void _apu_update_clocks(unsigned int cycle)
 	/* 32KHz is enough time for the DSP to output a sample */
 	if ((cycle & 0x1f) == 0) {
 		_dsp_run32();
+	} else {
+		_dsp_run16();
 	}
 
 	/* 8KHz clock (T0 and T1) */
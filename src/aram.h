@@ -1,3 +1,21 @@
 #pragma once
 
-extern uint8_t aram[0x10000];
+#include <stdint.h>
+
+#define ARAM_PAGE	4096
+/* where the RAM is in an SPC file */
+#define ARAM_LEAD	0x100
+
+/* ARAM is 0x100 bytes in to pages of its own, with room for the rest of an SPC
+ * file either side, so that one can be mapped over them copy-on-write instead
+ * of being copied in (spc700_restore_file()).
+ */
+struct aram_pages {
+	uint8_t lead[ARAM_LEAD];
+	uint8_t ram[0x10000];
+	uint8_t trail[ARAM_PAGE - ARAM_LEAD];
+} __attribute__((aligned(ARAM_PAGE)));
+
+extern struct aram_pages aram_pages;
+
+#define aram (aram_pages.ram)
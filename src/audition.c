@@ -0,0 +1,144 @@
+#include <spu-kit/audition.h>
+#include <spu-kit/dsp.h>
+
+#include "dsp-regs.h"
+#include "dsp.h"
+#include "aram.h"
+#include "system.h"
+
+#include <string.h>
+
+/* Long enough for any release envelope to finish, echo tails are cut off */
+#define RELEASE_TAIL	(DSP_HZ / 4)
+
+/* KON and KOFF are polled every other frame, so hold them for two frames to
+ * make sure they're seen exactly once.
+ */
+#define KEY_HOLD	2
+
+static uint8_t key_mask(unsigned int nr;
+			const struct audition_voice voices[static nr],
+			unsigned int nr,
+			const unsigned long frame,
+			const bool on)
+{
+	uint8_t mask = 0;
+
+	for (unsigned int i = 0; i < nr; i++) {
+		const unsigned long t = (on) ? voices[i].on : voices[i].off;
+
+		if (frame >= t && frame < t + KEY_HOLD)
+			mask |= 1U << i;
+	}
+
+	return mask;
+}
+
+static void program_voice(uint8_t regs[static 0x80],
+			const unsigned int i,
+			const struct audition_voice *v)
+{
+	uint8_t * const vr = &regs[i << 4];
+
+	vr[VREG_VOLL] = v->voll;
+	vr[VREG_VOLR] = v->volr;
+	vr[VREG_PLO] = v->pitch & 0xff;
+	vr[VREG_PHI] = (v->pitch >> 8) & 0x3f;
+	vr[VREG_SRCN] = v->srcn;
+	vr[VREG_ADSR1] = v->adsr1;
+	vr[VREG_ADSR2] = v->adsr2;
+	vr[VREG_GAIN] = v->gain;
+}
+
+__attribute__((cold))
+bool audition_run(unsigned int nr;
+		const uint8_t ram[static 0x10000],
+		const uint8_t dsp_regs[static 0x80],
+		const struct audition_voice voices[static nr],
+		unsigned int nr)
+{
+	uint8_t regs[0x80];
+	unsigned long end = 0;
+	uint8_t kon = 0, koff = 0;
+	uint8_t eon = 0;
+	uint16_t esa, edl;
+
+	if (!nr || nr > DSP_CHANNELS) {
+		say(ERR, "audition: %u voices, need 1 to %u", nr, DSP_CHANNELS);
+		return false;
+	}
+
+	/* Whatever the driver had playing stays silent, and nothing stops
+	 * ours being heard.
+	 */
+	memcpy(regs, dsp_regs, sizeof(regs));
+	regs[REG_KON] = 0;
+	regs[REG_KOFF] = 0;
+	regs[REG_FLG] &= ~(FLG_SOFT_RESET | FLG_MUTE);
+
+	for (unsigned int i = 0; i < nr; i++) {
+		const struct audition_voice * const v = &voices[i];
+
+		say(INFO, "audition: V%u: SRCN $%02x pitch $%04x "
+			"ADSR $%02x%02x GAIN $%02x vol %d/%d, %lu to %lu",
+			i, v->srcn, v->pitch, v->adsr1, v->adsr2, v->gain,
+			v->voll, v->volr, v->on, v->off);
+
+		if (v->off < v->on) {
+			say(ERR, "audition: V%u: key-off before key-on", i);
+			return false;
+		}
+
+		program_voice(regs, i, v);
+		if (v->echo)
+			eon |= 1U << i;
+
+		if (v->off > end)
+			end = v->off;
+	}
+
+	/* or the driver's echo plays on out of the buffer under ours */
+	regs[REG_EON] = eon;
+	if (eon) {
+		regs[REG_FLG] &= ~FLG_ECHO_DISABLED;
+	} else {
+		regs[REG_FLG] |= FLG_ECHO_DISABLED;
+		regs[REG_EVOLL] = 0;
+		regs[REG_EVOLR] = 0;
+		regs[REG_EFB] = 0;
+	}
+
+	memcpy(aram, ram, sizeof(aram));
+
+	/* an EDL of 0 still has the DSP using 4 bytes */
+	esa = regs[REG_ESA] * 0x100;
+	edl = (regs[REG_EDL] & 0xf) * 0x800;
+	if (!edl)
+		edl = 4;
+	for (unsigned int i = 0; i < edl; i++)
+		aram[(uint16_t)(esa + i)] = 0;
+
+	dsp_restore(regs);
+	dsp_set_length(end + RELEASE_TAIL);
+	dsp_set_fade(0);
+
+	for (unsigned long frame = 0; !dsp_done(); frame++) {
+		const uint8_t new_kon = key_mask(voices, nr, frame, true);
+		const uint8_t new_koff = key_mask(voices, nr, frame, false);
+
+		if (new_koff != koff) {
+			koff = new_koff;
+			_dsp_store(REG_KOFF, koff);
+		}
+
+		if (new_kon != kon) {
+			kon = new_kon;
+			_dsp_store(REG_KON, kon);
+		}
+
+		_dsp_run16();
+		_dsp_run32();
+	}
+
+	return dsp_finish();
+}
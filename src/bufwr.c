@@ -5,6 +5,7 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #define DEFAULT_BUF_SIZE	UINT32_C(8192)
 #define MAX_BUF_SIZE		UINT32_C(0x800000000)
@@ -53,9 +54,190 @@ out:
 	return f;
 }
 
+/* Async mode: the caller fills the buffer at head while a writer thread
+ * writes out the queued ones from tail onwards. Once a write fails, the rest
+ * are dropped, and the error sticks.
+ */
+struct bufwr_async {
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t drained;
+	pthread_t thread;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int queued;
+	unsigned int nr;
+	int fd;
+	int err;
+	bool stop;
+	struct {
+		uint8_t *ptr;
+		uint32_t len;
+	} slot[];
+};
+
+static void *writer(void *arg)
+{
+	struct bufwr_async * const a = arg;
+
+	pthread_mutex_lock(&a->lock);
+
+	for (;;) {
+		unsigned int i;
+		bool failed;
+
+		while (!a->queued && !a->stop)
+			pthread_cond_wait(&a->filled, &a->lock);
+
+		if (!a->queued)
+			break;
+
+		i = a->tail;
+		failed = a->err;
+		pthread_mutex_unlock(&a->lock);
+
+		if (!failed && !fd_write(a->fd, a->slot[i].ptr, a->slot[i].len)) {
+			pthread_mutex_lock(&a->lock);
+			a->err = errno;
+		} else {
+			pthread_mutex_lock(&a->lock);
+		}
+
+		a->tail = (a->tail + 1) % a->nr;
+		a->queued--;
+		pthread_cond_signal(&a->drained);
+	}
+
+	pthread_mutex_unlock(&a->lock);
+	return NULL;
+}
+
+/* Queue up what's in the buffer and move on to the next one, waiting for one
+ * to be free, or with drain, for them all to have been written.
+ */
+__attribute__((nonnull(1),warn_unused_result))
+static bool submit(bufwr_t *f, const bool drain)
+{
+	struct bufwr_async * const a = f->async;
+	int err;
+
+	pthread_mutex_lock(&a->lock);
+
+	if (f->cur) {
+		a->slot[a->head].len = f->cur;
+		a->head = (a->head + 1) % a->nr;
+		a->queued++;
+		pthread_cond_signal(&a->filled);
+	}
+
+	while (a->queued == a->nr || (drain && a->queued))
+		pthread_cond_wait(&a->drained, &a->lock);
+
+	err = a->err;
+	pthread_mutex_unlock(&a->lock);
+
+	f->buf = a->slot[a->head].ptr;
+	f->cur = 0;
+
+	if (unlikely(err)) {
+		f->corrupted = true;
+		errno = err;
+		return false;
+	}
+
+	return true;
+}
+
+/* Write out, or with discard drop, whatever's queued and go back to being
+ * synchronous, keeping the buffer we're on.
+ */
+__attribute__((nonnull(1)))
+static void async_stop(bufwr_t *f, const bool discard)
+{
+	struct bufwr_async * const a = f->async;
+	int err;
+
+	pthread_mutex_lock(&a->lock);
+	if (discard && !a->err)
+		a->err = ECANCELED;
+	a->stop = true;
+	pthread_cond_signal(&a->filled);
+	pthread_mutex_unlock(&a->lock);
+
+	err = pthread_join(a->thread, NULL);
+	if (unlikely(err))
+		say(ERR, "bufwr: pthread_join: %s", strerror(err));
+
+	for (unsigned int i = 0; i < a->nr; i++) {
+		if (a->slot[i].ptr != f->buf)
+			free(a->slot[i].ptr);
+	}
+
+	pthread_cond_destroy(&a->drained);
+	pthread_cond_destroy(&a->filled);
+	pthread_mutex_destroy(&a->lock);
+	free(a);
+	f->async = NULL;
+}
+
+__attribute__((warn_unused_result))
+bool bufwr_async(bufwr_t *f, const unsigned int nr_bufs)
+{
+	const unsigned int nr = (nr_bufs > 2) ? nr_bufs : 2;
+	struct bufwr_async *a;
+	int err;
+
+	/* nothing to wait on */
+	if (f->async || f->fd < 0)
+		return true;
+
+	a = calloc(1, sizeof(*a) + nr * sizeof(a->slot[0]));
+	if (unlikely(a == NULL))
+		goto out;
+
+	a->nr = nr;
+	a->fd = f->fd;
+
+	/* whatever's been written so far goes out first */
+	a->slot[0].ptr = f->buf;
+	for (unsigned int i = 1; i < nr; i++) {
+		a->slot[i].ptr = malloc(f->max);
+		if (unlikely(a->slot[i].ptr == NULL))
+			goto out_free;
+	}
+
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->filled, NULL);
+	pthread_cond_init(&a->drained, NULL);
+
+	err = pthread_create(&a->thread, NULL, writer, a);
+	if (unlikely(err)) {
+		errno = err;
+		goto out_destroy;
+	}
+
+	f->async = a;
+	return true;
+
+out_destroy:
+	pthread_cond_destroy(&a->drained);
+	pthread_cond_destroy(&a->filled);
+	pthread_mutex_destroy(&a->lock);
+out_free:
+	for (unsigned int i = 1; i < nr; i++)
+		free(a->slot[i].ptr);
+	free(a);
+out:
+	return false;
+}
+
 __attribute__((nonnull(1),warn_unused_result))
 static bool flush(bufwr_t *f)
 {
+	if (f->async) {
+		return submit(f, false);
+	}
+
 	/* -1 is basically /dev/null */
 	if (unlikely(f->fd < 0)) {
 		goto ok;
@@ -99,22 +281,25 @@ bool bufwr_write(bufwr_t *f,
 	const uint8_t *ptr = buf;
 	size_t remaining = len;
 
-	if (len >= space + f->max) {
+	/* in async mode, copying it is what stops us waiting on the write */
+	if (len >= space + f->max && !f->async) {
 		return large_write(f, buf, len);
 	}
 
 	/* If the arg is bigger than buffer space remaining, fill up the buffer
-	 * and write it out first
+	 * and write it out first, as many times as it takes
 	 */
-	if (len > space) {
-		memcpy(f->buf + f->cur, ptr, space);
-		f->cur += space;
+	while (remaining > f->max - f->cur) {
+		const size_t fill = f->max - f->cur;
+
+		memcpy(f->buf + f->cur, ptr, fill);
+		f->cur += fill;
 		if (unlikely(!flush(f))) {
 			return false;
 		}
 
-		ptr += space;
-		remaining -= space;
+		ptr += fill;
+		remaining -= fill;
 	}
 
 	/* Finally, memcpy the remainder into the buffer */
@@ -128,6 +313,11 @@ bool bufwr_write(bufwr_t *f,
 __attribute__((warn_unused_result))
 bool bufwr_flush(bufwr_t *f)
 {
+	/* there may be earlier buffers still on their way out */
+	if (f->async) {
+		return submit(f, true);
+	}
+
 	/* nothing to flush */
 	if (!f->cur) {
 		return true;
@@ -139,18 +329,28 @@ bool bufwr_flush(bufwr_t *f)
 __attribute__((nonnull(1)))
 void bufwr__fini(bufwr_t *f)
 {
+	if (f->async) {
+		async_stop(f, true);
+	}
 	free(f->buf);
 }
 
 __attribute__((nonnull(1)))
 void bufwr__abort(bufwr_t *f)
 {
+	/* the writer mustn't be left with an fd which may get reused */
+	if (f->async) {
+		async_stop(f, true);
+	}
 	if (f->fd >= 0) {
 		close(f->fd);
 	}
 	bufwr__fini(f);
 }
 
+/* cold or not depends on who's writing, not on us */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsuggest-attribute=cold"
 __attribute__((warn_unused_result, nonnull(1)))
 bool bufwr__close(bufwr_t *f, const bool sync)
 {
@@ -159,6 +359,11 @@ bool bufwr__close(bufwr_t *f, const bool sync)
 	if (unlikely(!bufwr_flush(f)))
 		ret = false;
 
+	/* all written by now, so this just waits for the writer to exit */
+	if (f->async) {
+		async_stop(f, false);
+	}
+
 	if (f->fd >= 0) {
 		if (sync && unlikely(fsync(f->fd))) {
 			switch (errno) {
@@ -179,6 +384,7 @@ bool bufwr__close(bufwr_t *f, const bool sync)
 	bufwr__fini(f);
 	return ret;
 }
+#pragma GCC diagnostic pop
 
 __attribute__((warn_unused_result))
 bool bufwr_close(bufwr_t *f, const bool sync)
@@ -6,6 +6,7 @@ struct bufwr {
 	uint32_t max;
 	int fd;
 	bool corrupted;
+	struct bufwr_async *async;
 };
 
 struct bufwr bufwr__init(const int fd, const size_t buf_size);
@@ -0,0 +1,495 @@
+#include <spu-kit/dsp-log.h>
+#include <spu-kit/dsp.h>
+#include <spu-kit/bufwr.h>
+
+#include "dsp-log.h"
+#include "dsp.h"
+#include "aram.h"
+#include "fd.h"
+#include "system.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <string.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* The log is a header, the DSP registers and all of ARAM, then a stream of
+ * records, each starting with an opcode byte:
+ *
+ *  00-7f	DSP store to that register, then the byte stored
+ *  80		ARAM store, then the address, little-endian, and the byte
+ *  81		LEB128 count of DSP clocks
+ *  c0-ff	1 to 64 DSP clocks
+ *
+ * A DSP clock is 16 cycles, they alternate between _dsp_run16() and
+ * _dsp_run32(), starting with whichever the header says.
+ */
+#define LOG_MAGIC	"SPUKLOG"
+#define LOG_VERSION	2
+
+#define LOG_ARAM	0x80
+#define LOG_CLOCKS	0x81
+#define LOG_CLOCK_RUN	0xc0
+#define LOG_RUN_MAX	(0x100 - LOG_CLOCK_RUN)
+
+struct log_hdr {
+	char magic[8];
+	uint32_t version;
+	uint8_t first_run32;
+	uint8_t reserved[3];
+	/* as given to dsp_set_length() and dsp_set_fade() */
+	uint32_t length;
+	uint32_t fade;
+	uint8_t regs[0x80];
+	uint8_t ram[0x10000];
+};
+static_assert(sizeof(struct log_hdr) == 24 + 0x80 + 0x10000, "log hdr size");
+
+/* the longest a count of clocks takes */
+#define LOG_CLOCKS_MAX	(1 + 5)
+
+bool _dsp_logging;
+
+/* Records are written as they happen, each straight after the clocks since
+ * the one before, and the ARAM stores the DSP had no use for are taken out
+ * at the end.
+ */
+static struct {
+	const char *fn;
+	int fd;
+	bufwr_t *f;
+	uint32_t clock;
+	/* when the last record was written */
+	uint32_t last;
+	bool first_run32;
+	bool failed;
+	size_t nr_stores;
+	size_t nr_aram;
+} rec = {
+	.fd = -1,
+};
+
+void dsp_log_record(const char *fn)
+{
+	rec.fn = fn;
+}
+
+__attribute__((cold))
+bool _dsp_log_begin(const uint8_t regs[static 0x80],
+			const uint8_t ram[static 0x10000],
+			const unsigned long length,
+			const unsigned long fade)
+{
+	const struct log_hdr hdr = {
+		.magic = LOG_MAGIC,
+		.version = htole32(LOG_VERSION),
+		.length = htole32(length),
+		.fade = htole32(fade),
+	};
+
+	if (rec.fn == NULL || _dsp_logging)
+		return false;
+
+	rec.fd = open(rec.fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (rec.fd < 0) {
+		say(ERR, "%s: open: %s", rec.fn, strerror(errno));
+		return false;
+	}
+
+	/* the registers and ARAM go in now, the rest of it when we're done */
+	if (!fd_write(rec.fd, (const uint8_t *)&hdr,
+				offsetof(struct log_hdr, regs))
+			|| !fd_write(rec.fd, regs, sizeof(hdr.regs))
+			|| !fd_write(rec.fd, ram, sizeof(hdr.ram))) {
+		say(ERR, "%s: write: %s", rec.fn, strerror(errno));
+		close(rec.fd);
+		rec.fd = -1;
+		return false;
+	}
+
+	rec.f = bufwr_new(rec.fd, 0);
+	if (rec.f == NULL) {
+		say(ERR, "%s: out of memory", rec.fn);
+		close(rec.fd);
+		rec.fd = -1;
+		return false;
+	}
+
+	rec.clock = 0;
+	rec.last = 0;
+	rec.nr_stores = 0;
+	rec.nr_aram = 0;
+	rec.failed = false;
+	_dsp_logging = true;
+
+	say(INFO, "dsp: recording to %s", rec.fn);
+	return true;
+}
+
+void _dsp_log_clock(const bool run32)
+{
+	if (unlikely(!rec.clock))
+		rec.first_run32 = run32;
+
+	rec.clock++;
+}
+
+static unsigned int encode_clocks(uint8_t buf[static LOG_CLOCKS_MAX],
+					uint32_t n)
+{
+	unsigned int len = 0;
+
+	if (!n)
+		return 0;
+
+	if (n <= LOG_RUN_MAX) {
+		buf[len++] = LOG_CLOCK_RUN + n - 1;
+		return len;
+	}
+
+	buf[len++] = LOG_CLOCKS;
+	do {
+		buf[len++] = (n & 0x7f) | ((n > 0x7f) ? 0x80 : 0);
+		n >>= 7;
+	} while (n);
+
+	return len;
+}
+
+__attribute__((noinline))
+static void log_put(const uint8_t *buf, const unsigned int len)
+{
+	uint8_t clocks[LOG_CLOCKS_MAX];
+	const unsigned int nr = encode_clocks(clocks, rec.clock - rec.last);
+
+	if (unlikely(rec.failed))
+		return;
+
+	if (unlikely(!bufwr_write(rec.f, clocks, nr)
+			|| !bufwr_write(rec.f, buf, len))) {
+		say(ERR, "%s: write: %s", rec.fn, strerror(errno));
+		rec.failed = true;
+		return;
+	}
+
+	rec.last = rec.clock;
+}
+
+void _dsp_log_store(const uint8_t addr, const uint8_t byte)
+{
+	const uint8_t buf[] = {addr, byte};
+
+	rec.nr_stores++;
+	log_put(buf, sizeof(buf));
+}
+
+void _dsp_log_aram(const uint16_t addr, const uint8_t byte)
+{
+	const uint8_t buf[] = {LOG_ARAM, addr & 0xff, addr >> 8, byte};
+
+	rec.nr_aram++;
+	log_put(buf, sizeof(buf));
+}
+
+/* Take the ARAM stores to pages the DSP never read out of the records from
+ * start to *end in fd, moving the rest down over them, and merging the clocks
+ * either side of each. There's only ever one count of clocks before a record
+ * as written, so that's never longer than what it replaces, and the records
+ * can be written back behind where they're read from, a buffer at a time.
+ */
+__attribute__((cold))
+static bool log_compact(const int fd, const off_t start, off_t *end,
+			const bool seen[static 0x100], size_t *nr_kept)
+{
+	static uint8_t in[0x10000], out[0x10000];
+	off_t in_off = start, out_off = start;
+	size_t pos = 0, len = 0, nr_out = 0;
+	uint32_t clocks = 0;
+
+	for (;;) {
+		unsigned int n;
+		uint8_t op;
+
+		if (len - pos < LOG_CLOCKS_MAX && in_off < *end) {
+			ssize_t ret;
+
+			memmove(in, in + pos, len - pos);
+			len -= pos;
+			pos = 0;
+
+			ret = pread(fd, in + len, sizeof(in) - len, in_off);
+			if (ret <= 0)
+				return false;
+			len += ret;
+			in_off += ret;
+		}
+
+		if (pos == len)
+			break;
+
+		op = in[pos];
+		if (op >= LOG_CLOCK_RUN) {
+			clocks += op - LOG_CLOCK_RUN + 1;
+			pos++;
+			continue;
+		}
+
+		if (op == LOG_CLOCKS) {
+			uint32_t c = 0;
+
+			pos++;
+			for (unsigned int shift = 0; pos < len; shift += 7) {
+				c |= (uint32_t)(in[pos] & 0x7f) << shift;
+				if (!(in[pos++] & 0x80))
+					break;
+			}
+			clocks += c;
+			continue;
+		}
+
+		n = (op == LOG_ARAM) ? 4 : 2;
+		if (op == LOG_ARAM) {
+			if (!seen[in[pos + 2]]) {
+				pos += n;
+				continue;
+			}
+			(*nr_kept)++;
+		}
+
+		if (nr_out > sizeof(out) - LOG_CLOCKS_MAX - n) {
+			if (!fd_pwrite(fd, out_off, out, nr_out))
+				return false;
+			out_off += nr_out;
+			nr_out = 0;
+		}
+
+		nr_out += encode_clocks(out + nr_out, clocks);
+		clocks = 0;
+		memcpy(out + nr_out, in + pos, n);
+		nr_out += n;
+		pos += n;
+	}
+
+	if (nr_out > sizeof(out) - LOG_CLOCKS_MAX) {
+		if (!fd_pwrite(fd, out_off, out, nr_out))
+			return false;
+		out_off += nr_out;
+		nr_out = 0;
+	}
+
+	nr_out += encode_clocks(out + nr_out, clocks);
+	if (!fd_pwrite(fd, out_off, out, nr_out))
+		return false;
+
+	*end = out_off + nr_out;
+	return true;
+}
+
+__attribute__((cold))
+bool _dsp_log_end(const bool seen[static 0x100])
+{
+	const uint8_t first_run32 = rec.first_run32;
+	uint8_t clocks[LOG_CLOCKS_MAX];
+	size_t nr_kept = 0;
+	struct stat st;
+	off_t end;
+	bool ret = false;
+
+	if (!_dsp_logging)
+		return true;
+
+	_dsp_logging = false;
+
+	if (rec.failed)
+		goto out_abort;
+
+	if (!bufwr_write(rec.f, clocks,
+				encode_clocks(clocks, rec.clock - rec.last))
+			|| !bufwr_flush(rec.f)
+			|| !fd_pwrite(rec.fd,
+				offsetof(struct log_hdr, first_run32),
+				&first_run32, sizeof(first_run32))
+			|| fstat(rec.fd, &st)) {
+		say(ERR, "%s: write: %s", rec.fn, strerror(errno));
+		goto out_abort;
+	}
+
+	end = st.st_size;
+	if (!log_compact(rec.fd, sizeof(struct log_hdr), &end, seen,
+				&nr_kept)) {
+		say(ERR, "%s: compacting: %s", rec.fn, strerror(errno));
+		goto out_abort;
+	}
+
+	if (ftruncate(rec.fd, end)) {
+		say(ERR, "%s: truncate: %s", rec.fn, strerror(errno));
+		goto out_abort;
+	}
+
+	ret = bufwr_close(rec.f, false);
+	if (!ret)
+		say(ERR, "%s: write: %s", rec.fn, strerror(errno));
+
+	say(INFO, "dsp: recorded %zu stores and %zu of %zu ARAM stores "
+		"over %u clocks",
+		rec.nr_stores, nr_kept, rec.nr_aram, rec.clock);
+	goto out;
+
+out_abort:
+	bufwr_abort(rec.f);
+out:
+	rec.f = NULL;
+	rec.fd = -1;
+	return ret;
+}
+
+static void replay_clocks(uint32_t n, bool *run32)
+{
+	while (n-- && !dsp_done()) {
+		if (*run32) {
+			_dsp_run32();
+		} else {
+			_dsp_run16();
+		}
+		*run32 = !*run32;
+	}
+}
+
+/* Just as the CPU would, see mem_store() */
+static void replay_aram(const uint16_t addr, const uint8_t byte)
+{
+	if (unlikely(dsp_aram_watched(addr))) {
+		_dsp_aram_touch();
+	}
+	aram[addr] = byte;
+	dsp_aram_written(addr, byte);
+}
+
+static bool replay(const char *fn,
+			const uint8_t *ptr,
+			const uint8_t *end,
+			const bool log_length,
+			const bool log_fade)
+{
+	const struct log_hdr *hdr = (const struct log_hdr *)ptr;
+	bool run32;
+
+	if (end - ptr < (ptrdiff_t)sizeof(*hdr)
+			|| memcmp(hdr->magic, LOG_MAGIC, sizeof(hdr->magic))) {
+		say(ERR, "%s: not a DSP log", fn);
+		return false;
+	}
+
+	if (le32toh(hdr->version) != LOG_VERSION) {
+		say(ERR, "%s: DSP log version %u, expected %u",
+			fn, le32toh(hdr->version), LOG_VERSION);
+		return false;
+	}
+
+	if (log_length)
+		dsp_set_length(le32toh(hdr->length));
+	if (log_fade)
+		dsp_set_fade(le32toh(hdr->fade));
+
+	memcpy(aram, hdr->ram, sizeof(hdr->ram));
+	dsp_restore(hdr->regs);
+
+	run32 = hdr->first_run32;
+	ptr += sizeof(*hdr);
+
+	while (ptr < end && !dsp_done()) {
+		const uint8_t op = *ptr++;
+		uint32_t n = 0;
+
+		if (op < LOG_ARAM) {
+			if (end - ptr < 1)
+				goto truncated;
+			_dsp_store(op, ptr[0]);
+			ptr += 1;
+		} else if (op == LOG_ARAM) {
+			if (end - ptr < 3)
+				goto truncated;
+			replay_aram(ptr[0] | (ptr[1] << 8), ptr[2]);
+			ptr += 3;
+		} else if (op == LOG_CLOCKS) {
+			for (unsigned int shift = 0; ; shift += 7) {
+				if (ptr == end || shift > 28)
+					goto truncated;
+				n |= (uint32_t)(*ptr & 0x7f) << shift;
+				if (!(*ptr++ & 0x80))
+					break;
+			}
+			replay_clocks(n, &run32);
+		} else if (op >= LOG_CLOCK_RUN) {
+			replay_clocks(op - LOG_CLOCK_RUN + 1, &run32);
+		} else {
+			say(ERR, "%s: bad DSP log opcode $%02x", fn, op);
+			goto err;
+		}
+	}
+
+	/* The render finishes by itself, and the log ends with it, but in
+	 * case this one was cut short, or is a different length, let the
+	 * DSP run on until it does.
+	 */
+	while (!dsp_done())
+		replay_clocks(2, &run32);
+
+	return dsp_finish();
+
+truncated:
+	say(ERR, "%s: truncated DSP log", fn);
+err:
+	/* keep whatever was rendered up to here */
+	if (!dsp_finish())
+		say(ERR, "%s: render failed", fn);
+	return false;
+}
+
+__attribute__((cold))
+bool dsp_log_replay(const char *fn,
+			const bool log_length,
+			const bool log_fade)
+{
+	bool ret = false;
+	struct stat st;
+	void *map;
+	int fd;
+
+	say(INFO, "replay: %s", fn);
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0) {
+		say(ERR, "%s: open: %s", fn, strerror(errno));
+		goto out;
+	}
+
+	if (fstat(fd, &st)) {
+		say(ERR, "%s: stat: %s", fn, strerror(errno));
+		goto out_close;
+	}
+
+	if (!st.st_size) {
+		say(ERR, "%s: not a DSP log", fn);
+		goto out_close;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		say(ERR, "%s: mmap: %s", fn, strerror(errno));
+		goto out_close;
+	}
+
+	ret = replay(fn, map, (const uint8_t *)map + st.st_size,
+			log_length, log_fade);
+
+	munmap(map, st.st_size);
+out_close:
+	close(fd);
+out:
+	return ret;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* set while recording, the DSP calls the hooks below */
+extern bool _dsp_logging;
+
+/* Start recording if dsp_log_record() asked for it, returns whether it did */
+bool _dsp_log_begin(const uint8_t regs[static 0x80],
+			const uint8_t ram[static 0x10000],
+			const unsigned long length,
+			const unsigned long fade);
+
+void _dsp_log_clock(const bool run32);
+void _dsp_log_store(const uint8_t addr, const uint8_t byte);
+void _dsp_log_aram(const uint16_t addr, const uint8_t byte);
+
+/* Finish the log, taking out the ARAM stores to pages the DSP never read */
+__attribute__((warn_unused_result))
+bool _dsp_log_end(const bool seen[static 0x100]);
@@ -60,6 +60,7 @@ struct vregs {
 #define FLG_MUTE		(1U << 6)
 #define FLG_ECHO_DISABLED	(1U << 5)
 #define FLG_FLAGS		(FLG_SOFT_RESET | FLG_MUTE | FLG_ECHO_DISABLED)
+#define FLG_NOISE_RATE_MASK	0x1f
 
 #define REG_MVOLL		0x0c
 #define REG_MVOLR		0x1c
@@ -1,13 +1,18 @@
 #include <spu-kit/dsp.h>
 #include <spu-kit/wav.h>
+#include <spu-kit/sink.h>
 
 #include "dsp-regs.h"
+#include "dsp-log.h"
 #include "dsp.h"
 #include "aram.h"
 #include "system.h"
 
+#include <stdatomic.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <endian.h>
 
 //#define BRR_DECODE_TRACE
@@ -26,6 +31,12 @@
 #endif
 
 static uint8_t regs[0x80];
+
+/* The DSP's view of ARAM. This is the CPU's ARAM, unless we're pipelined, in
+ * which case the DSP has its own copy which the CPU's writes are forwarded to.
+ */
+static uint8_t *ram = aram;
+
 #pragma GCC push_options
 #pragma GCC optimize("short-enums")
 typedef enum {
@@ -58,11 +69,14 @@ struct fat_sample {
 };
 
 #define BRR_BUF_SZ 12
+/* The first 8 samples are mirrored past the end of the ring so that the
+ * interpolator can read 4 consecutive taps without wrapping.
+ */
+#define BRR_BUF_MIRROR 8
 struct vstate {
 	int interp_pos;
 	int env;
 	uint16_t srcn_ptr;
-	uint16_t next_brr_addr;
 	uint16_t brr_addr;
 	uint16_t pitch;
 	env_state_t env_mode;
@@ -70,7 +84,23 @@ struct vstate {
 	uint8_t brr_off;
 	uint8_t buf_pos;
 	uint8_t attack_delay;
-	int16_t buf[BRR_BUF_SZ];
+	int16_t buf[BRR_BUF_SZ + BRR_BUF_MIRROR];
+	/* ctr_clock at which the envelope next needs looking at, 0 forces it */
+	unsigned long env_due;
+
+	/* last interpolated sample and envelope, for OUTX and ENVX */
+	int16_t out;
+	int16_t env_out;
+
+	/* derived from the voice registers by voice_decode() */
+	uint16_t dir_ptr;
+	uint16_t pitch_reg;
+	int8_t voll;
+	int8_t volr;
+	bool adsr;
+	uint8_t env_rate[4];
+	uint8_t sustain_level;
+	uint8_t gain;
 };
 
 static const uint8_t ctr_number[32] = {
@@ -110,6 +140,9 @@ static const uint8_t ctr_internal_init[3] = {1, 2, 3};
 static unsigned int ctr_out[3];
 static const unsigned int ctr_initial[3] = {0, -347, -107};
 
+/* number of times ctr_run() has been called */
+static unsigned long ctr_clock;
+
 static inline void ctr_init(void)
 {
 	for (int i = 0; i < 3; i++) {
@@ -120,6 +153,7 @@ static inline void ctr_init(void)
 
 static inline void ctr_run(void)
 {
+	ctr_clock++;
 	ctr_out[0]++;
 
 	if (!--ctr_internal[1]) {
@@ -151,8 +185,117 @@ static inline bool ctr_read(unsigned int rate)
 	return ctr_internal[ctr_nr] == ctr_rate[ctr_nr];
 }
 
+/* The value of ctr_clock when ctr_read(rate) will next be true, not counting
+ * the current sample. Counter n ticks once every ctr_internal[n] samples from
+ * now and ctr_rate[n] after that, and we want the first tick which leaves the
+ * bits in ctr_mask[rate] clear.
+ */
+__attribute__((pure))
+static unsigned long ctr_next(const unsigned int rate)
+{
+	const uint8_t ctr_nr = ctr_number[rate];
+	unsigned int ticks;
+
+	if (rate == 0)
+		return ULONG_MAX;
+
+	ticks = -(ctr_out[ctr_nr] + 1) & ctr_mask[rate];
+
+	return ctr_clock + ctr_internal[ctr_nr] + ticks * ctr_rate[ctr_nr];
+}
+
+/* same as calling ctr_run() n times */
+static void ctr_skip(const unsigned long n)
+{
+	ctr_clock += n;
+	ctr_out[0] += n;
+
+	for (int i = 1; i < 3; i++) {
+		const unsigned long steps = n + ctr_rate[i] - ctr_internal[i];
+
+		ctr_out[i] += steps / ctr_rate[i];
+		ctr_internal[i] = ctr_rate[i] - (steps % ctr_rate[i]);
+	}
+}
+
+/* The number of times ctr_read(rate) will be true over the next n samples */
+__attribute__((pure))
+static unsigned long ctr_hits(const unsigned int rate, const unsigned long n)
+{
+	const unsigned long next = ctr_next(rate);
+	unsigned long period;
+
+	if (next > ctr_clock + n)
+		return 0;
+
+	period = (ctr_mask[rate] + 1UL) * ctr_rate[ctr_number[rate]];
+	return 1 + (ctr_clock + n - next) / period;
+}
+
+/* The 15-bit noise LFSR only ever goes round the same 32767 states, so we
+ * precompute the sequence, already scaled to a sample, and just step through
+ * it whenever the FLG noise rate says so.
+ */
+#define NOISE_PERIOD	0x7fff
+#define NOISE_INITIAL	0x4000
+static int16_t noise_seq[NOISE_PERIOD];
+static unsigned int noise_idx;
+
+static void noise_init(void)
+{
+	unsigned int lfsr = NOISE_INITIAL;
+
+	for (unsigned int i = 0; i < NOISE_PERIOD; i++) {
+		const unsigned int feedback = (lfsr << 13) ^ (lfsr << 14);
+
+		noise_seq[i] = (int16_t)(lfsr << 1);
+		lfsr = (feedback & 0x4000) ^ (lfsr >> 1);
+	}
+
+	xassert(lfsr == NOISE_INITIAL);
+}
+
+static inline void noise_advance(const unsigned long n)
+{
+	noise_idx = (noise_idx + n) % NOISE_PERIOD;
+}
+
 static struct vstate vstate[DSP_CHANNELS];
 
+/* Set by store() when a voice's registers change, or all of them when DIR
+ * does, and cleared once voice_decode() has caught up.
+ */
+static uint8_t vdirty;
+
+/* same for the global registers and globals_decode() */
+static bool gdirty;
+static int8_t mvol_l;
+static int8_t mvol_r;
+static int8_t evol_l;
+static int8_t evol_r;
+static bool echo_bypass;
+
+/* Voices modulated by the previous voice's output, cached from PMON. Voice 0
+ * has no previous voice and is never modulated. Everything else about the
+ * voices can run in parallel, these alone need vout[i - 1] first.
+ */
+static uint8_t pmon_mask;
+
+/* each voice's output after the envelope, for pitch modulation */
+static int16_t vout[DSP_CHANNELS];
+
+/* Voices which aren't to be heard. They still run their envelopes and decode
+ * BRR, so ENDX, ENVX and the sample position carry on as normal, but aren't
+ * interpolated or mixed. Unless the next voice is pitch modulated by them,
+ * in which case they're computed but still not mixed.
+ */
+static uint8_t voice_mute;
+
+/* each voice's panned output, and the echo return, for stems */
+static struct sample stems[DSP_STEMS];
+
+static dsp_interp_t interp_mode = DSP_INTERP_GAUSS;
+
 /* KON/KOF when last checked */
 static uint8_t kon;
 static uint8_t koff;
@@ -172,8 +315,24 @@ static uint16_t echo_offset;
 static uint16_t echo_length;
 static uint16_t echo_ptr;
 
+/* Number of consecutive samples for which the echo buffer has been in the
+ * ring, and everything read from it or written to it has been zero.
+ */
+static unsigned int echo_quiet;
+
+/* Fast-forwarding through silence, see quiescent(). idle_skipped is how many
+ * samples the DSP state is behind by, idle_frames is how many silent frames
+ * we owe the output.
+ */
+static bool idle;
+static unsigned long idle_skipped;
+static unsigned int idle_frames;
+
+/* The FIR history is stored twice over so that the 8 most recent samples are
+ * always contiguous, oldest first, starting just after echo_hist_pos.
+ */
 #define ECHO_HIST_SIZE 8
-static struct sample echo_hist[ECHO_HIST_SIZE];
+static struct sample echo_hist[ECHO_HIST_SIZE * 2] __attribute__((aligned(32)));
 static uint8_t echo_hist_pos;
 
 __attribute__((always_inline))
@@ -330,7 +489,7 @@ static inline struct brr_pair brr_pair_extract(const uint8_t byte)
 __attribute__((always_inline))
 static inline struct brr_pair brr_pair_load(const uint16_t addr)
 {
-	return brr_pair_extract(aram[addr]);
+	return brr_pair_extract(ram[addr]);
 }
 
 static inline struct brr_pair brr_pair_scale(const struct brr_pair in, uint8_t shift)
@@ -407,7 +566,7 @@ static struct brr_block decode_brr(uint16_t aptr,
 					const struct brr_filter_state *st,
 					bool *end, bool *loop)
 {
-	const uint8_t ctrl = aram[aptr];
+	const uint8_t ctrl = ram[aptr];
 	const uint8_t filter = (ctrl >> 2) & 3;
 	const uint8_t scale = ctrl >> 4;
 	const uint8_t shift = (scale > 12) ? 12 : scale;
@@ -522,19 +681,32 @@ static uint16_t voice_srcn_pointer(unsigned int i, const struct vregs *v)
 	return srcn_effective_addr(v->srcn);
 }
 
-__attribute__((always_inline))
-static inline uint16_t read_aram_byte(const uint16_t addr)
-{
-	return aram[addr];
-}
+/* Shadow of the echo buffer. While it's live, the ARAM covered by ring is
+ * stale and the real contents are in here, one word per echo buffer word.
+ * The CPU calls _dsp_aram_touch() before accessing any of that range, which
+ * mirrors the ring back and hands the buffer back to ARAM until the DSP next
+ * wraps around the echo buffer and reclaims it.
+ *
+ * _dsp_watch is the range the CPU has to look out for, which is the same
+ * thing unless we're pipelined, see pipe_watch_reset().
+ */
+#define ECHO_MAX_LEN	(0xf * 0x800)
+static uint16_t echo_ring[ECHO_MAX_LEN / 2] __attribute__((aligned(64)));
+static struct dsp_aram_watch ring;
+struct dsp_aram_watch _dsp_watch;
+
+/* While recording a log, the pages of ARAM which the DSP has read, or might
+ * read: CPU writes anywhere else can be left out of the log.
+ */
+static bool log_seen[0x100];
 
 __attribute__((always_inline))
-static inline uint16_t read_aram_word(const uint16_t addr)
+static inline uint16_t aram_word(const uint16_t addr)
 {
 	const uint16_t word_lo = addr + 0;
 	const uint16_t word_hi = addr + 1;
 
-	return (aram[word_hi] << 8) | aram[word_lo];
+	return (ram[word_hi] << 8) | ram[word_lo];
 }
 
 __attribute__((always_inline))
@@ -543,8 +715,104 @@ static inline void write_aram_word(const uint16_t addr, const uint16_t val)
 	const uint16_t word_lo = addr + 0;
 	const uint16_t word_hi = addr + 1;
 
-	aram[word_hi] = val >> 8;
-	aram[word_lo] = val & 0xff;
+	ram[word_hi] = val >> 8;
+	ram[word_lo] = val & 0xff;
+}
+
+/* For everything other than the echo buffer itself, eg. a sample which lives
+ * in the echo buffer.
+ */
+__attribute__((always_inline))
+static inline uint8_t read_aram_byte(const uint16_t addr)
+{
+	const uint16_t off = addr - ring.base;
+
+	if (unlikely(_dsp_logging))
+		log_seen[addr >> 8] = true;
+
+	if (unlikely(off < ring.len))
+		return echo_ring[off >> 1] >> ((off & 1) * 8);
+
+	return ram[addr];
+}
+
+__attribute__((always_inline))
+static inline uint16_t read_aram_word(const uint16_t addr)
+{
+	return (read_aram_byte(addr + 1) << 8) | read_aram_byte(addr + 0);
+}
+
+__attribute__((always_inline))
+static inline uint16_t echo_word_load(const uint16_t addr)
+{
+	const uint16_t off = addr - ring.base;
+
+	if (likely(off < ring.len))
+		return echo_ring[off >> 1];
+
+	return aram_word(addr);
+}
+
+__attribute__((always_inline))
+static inline void echo_word_store(const uint16_t addr, const uint16_t val)
+{
+	const uint16_t off = addr - ring.base;
+
+	if (likely(off < ring.len)) {
+		echo_ring[off >> 1] = val;
+		return;
+	}
+
+	write_aram_word(addr, val);
+}
+
+static void echo_ring_mirror(void)
+{
+	for (uint16_t off = 0; off < ring.len; off += 2) {
+		write_aram_word(ring.base + off, echo_ring[off >> 1]);
+	}
+}
+
+__attribute__((noinline))
+static void echo_ring_drop(void)
+{
+	echo_ring_mirror();
+	ring.len = 0;
+
+	if (!_dsp_pipelined)
+		_dsp_watch = ring;
+}
+
+__attribute__((noinline))
+static void echo_ring_claim(const uint16_t base, const uint16_t len)
+{
+	xassert(len <= ECHO_MAX_LEN);
+
+	for (uint16_t off = 0; off < len; off += 2) {
+		echo_ring[off >> 1] = aram_word(base + off);
+	}
+
+	ring.base = base;
+	ring.len = len;
+
+	if (!_dsp_pipelined)
+		_dsp_watch = ring;
+}
+
+/* called at the start of each pass through the echo buffer */
+static inline void echo_ring_reclaim(void)
+{
+	const uint16_t base = esa * 0x100;
+	const uint16_t len = (echo_length) ? echo_length : 4;
+
+	if (likely(ring.base == base && ring.len == len))
+		return;
+
+	if (ring.len)
+		echo_ring_drop();
+
+	echo_ring_claim(base, len);
+	echo_quiet = 0;
 }
 
 struct dir_entry {
@@ -573,7 +841,7 @@ static inline void dump_srcn(const uint8_t srcn)
 	wav_t *wav;
 
 	snprintf(wavname, sizeof(wavname), "src-%u.wav", srcn);
-	wav = wav_create(wavname);
+	wav = wav_create(wavname, DSP_HZ, 1);
 
 	xassert(wav != NULL);
 
@@ -609,7 +877,7 @@ static inline void dump_samples(void)
 __attribute__((always_inline))
 static inline uint8_t brr_byte(struct vstate * const st)
 {
-	return aram[st->brr_addr + st->brr_off++];
+	return read_aram_byte(st->brr_addr + st->brr_off++);
 }
 
 static inline struct brr_filter_state vfilter_state(const struct vstate * const st)
@@ -668,6 +936,11 @@ static void brr_sample4(struct vstate * const st)
 	st->buf[st->buf_pos + 1] = clamp16(b);
 	st->buf[st->buf_pos + 2] = clamp16(c);
 	st->buf[st->buf_pos + 3] = clamp16(d);
+	if (st->buf_pos < BRR_BUF_MIRROR) {
+		memcpy(st->buf + BRR_BUF_SZ + st->buf_pos,
+			st->buf + st->buf_pos,
+			4 * sizeof(st->buf[0]));
+	}
 	st->buf_pos += 4;
 	if (st->buf_pos >= BRR_BUF_SZ)
 		st->buf_pos = 0;
@@ -708,6 +981,23 @@ static int16_t const gauss[512] = {
 	1299,1300,1300,1301,1302,1302,1303,1303,1303,1304,1304,1304,1304,1304,1305,1305,
 };
 
+/* gauss[] rearranged so that the four kernel weights for a given position
+ * are adjacent, in the same order as the taps they are applied to. Built
+ * once by init().
+ */
+static int16_t gauss4[256][4] __attribute__((aligned(8)));
+
+__attribute__((cold))
+static void gauss4_init(void)
+{
+	for (int i = 0; i < 256; i++) {
+		gauss4[i][0] = gauss[255 - i];
+		gauss4[i][1] = gauss[511 - i];
+		gauss4[i][2] = gauss[256 + i];
+		gauss4[i][3] = gauss[i];
+	}
+}
+
 __attribute__((pure))
 static uint8_t wrap12(const uint8_t val)
 {
@@ -722,27 +1012,18 @@ struct envelope {
 };
 
 __attribute__((pure))
-static struct envelope run_adsr_env(struct vstate * const st,
-					const uint8_t adsr1,
-					const uint8_t adsr2)
+static struct envelope run_adsr_env(struct vstate * const st)
 {
-	int r;
+	const int r = st->env_rate[st->env_mode];
 
 	switch (st->env_mode) {
 	case ENV_ATTACK:
-		r = (adsr1 & ADSR1_ATTACK_RATE_MASK) * 2 + 1;
 		return (struct envelope){
 			.env = st->env + ((r == 0x1f) ? 0x400 : 0x20),
 			.rate = r,
 		};
 	case ENV_SUSTAIN:
-		r = adsr2 & ADSR2_SUSTAIN_RATE_MASK;
-		return (struct envelope) {
-			.env = st->env - ((st->env >> 8) + 1),
-			.rate = r,
-		};
 	case ENV_DECAY:
-		r = 0x10 + ((adsr1 >> ADSR1_DECAY_RATE_SHIFT) & ADSR1_DECAY_RATE_MASK);
 		return (struct envelope) {
 			.env = st->env - ((st->env >> 8) + 1),
 			.rate = r,
@@ -755,7 +1036,6 @@ static struct envelope run_adsr_env(struct vstate * const st,
 
 __attribute__((pure,noinline))
 static struct envelope run_gain_env(struct vstate * const st,
-					const uint8_t adsr1,
 					const uint8_t gain)
 {
 	const bool custom = gain & GAIN_MODE_CUSTOM;
@@ -800,12 +1080,11 @@ static inline void envelope_release(struct vstate * const st)
 	}
 }
 
-static void run_envelope(struct vstate * const st,
-			const uint8_t adsr1,
-			const uint8_t adsr2,
-			const uint8_t gain)
+static void run_envelope(struct vstate * const st)
 {
-	uint8_t sustain_target;
+	const env_state_t prev_mode = st->env_mode;
+	const int prev_env = st->env;
+	const uint8_t sustain_target = st->sustain_level;
 	struct envelope ret;
 
 	if (st->env_mode == ENV_RELEASE) {
@@ -814,12 +1093,17 @@ static void run_envelope(struct vstate * const st,
 		return;
 	}
 
-	if (likely(adsr1 & ADSR1_USE_ADSR)) {
-		sustain_target = adsr2 >> ADSR2_SUSTAIN_LEVEL_SHIFT;
-		ret = run_adsr_env(st, adsr1, adsr2);
+	/* Everything below is a function of env, env_mode, the envelope
+	 * registers and the counter. So if the first three haven't changed
+	 * then nothing happens until the counter next fires for this rate.
+	 */
+	if (likely(ctr_clock < st->env_due))
+		return;
+
+	if (likely(st->adsr)) {
+		ret = run_adsr_env(st);
 	} else {
-		sustain_target = gain >> ADSR2_SUSTAIN_LEVEL_SHIFT;
-		ret = run_gain_env(st, adsr1, gain);
+		ret = run_gain_env(st, st->gain);
 	}
 
 	/* trigger sustain? */
@@ -838,6 +1122,16 @@ static void run_envelope(struct vstate * const st,
 	if (ctr_read(ret.rate)) {
 		st->env = ret.env;
 	}
+
+	if (st->env_mode != prev_mode || st->env != prev_env) {
+		/* may trigger the next mode, so look again next sample */
+		st->env_due = 0;
+	} else if (ret.env == prev_env) {
+		/* stuck here until a register changes */
+		st->env_due = ULONG_MAX;
+	} else {
+		st->env_due = ctr_next(ret.rate);
+	}
 }
 
 __attribute__((pure))
@@ -864,6 +1158,63 @@ static int interpolate(struct vstate * const st)
 	return out & ~1;
 }
 
+/* taps 0..3 for the current position, straight out of the mirrored buffer */
+__attribute__((always_inline))
+static inline const int16_t *interp_taps(const struct vstate * const st)
+{
+	const uint8_t interp_hi = (st->interp_pos >> 12) & 0x7;
+
+	return st->buf + st->buf_pos + interp_hi;
+}
+
+__attribute__((pure))
+static int interpolate_linear(const struct vstate * const st)
+{
+	const int16_t * const in = interp_taps(st);
+	const int frac = st->interp_pos & 0xfff;
+
+	return (in[1] + (((in[2] - in[1]) * frac) >> 12)) & ~1;
+}
+
+__attribute__((pure))
+static int interpolate_none(const struct vstate * const st)
+{
+	return interp_taps(st)[1] & ~1;
+}
+
+typedef int32_t v8si __attribute__((vector_size(DSP_CHANNELS * sizeof(int32_t))));
+
+/* Same arithmetic as interpolate(), but lane i of each vector is voice i so
+ * that the multiplies, shifts and sums happen for all voices at once. Voices
+ * which turn out not to need a sample are computed anyway, it's cheaper than
+ * branching.
+ */
+static int interp_simd[DSP_CHANNELS];
+
+static void interpolate_simd(int out[static DSP_CHANNELS])
+{
+	v8si in[4], k[4], acc;
+
+	for (int i = 0; i < DSP_CHANNELS; i++) {
+		const struct vstate * const st = &vstate[i];
+		const int16_t * const taps = interp_taps(st);
+		const int16_t * const w = gauss4[(uint8_t)(st->interp_pos >> 4)];
+
+		for (int t = 0; t < 4; t++) {
+			in[t][i] = taps[t];
+			k[t][i] = w[t];
+		}
+	}
+
+	acc = (k[0] * in[0]) >> 11;
+	acc += (k[1] * in[1]) >> 11;
+	acc += (k[2] * in[2]) >> 11;
+	acc += (k[3] * in[3]) >> 11;
+	acc &= ~1;
+
+	memcpy(out, &acc, sizeof(acc));
+}
+
 __attribute__((pure,always_inline))
 static inline struct sample silence(void)
 {
@@ -943,16 +1294,54 @@ static inline struct sample pan(const int sample, const int8_t voll, const int8_
 	};
 }
 
-static struct sample voice_run(const unsigned int i)
+/* Everything we need from a voice's registers, in the form we need it. None
+ * of these registers are read at any other time.
+ */
+static void voice_decode(const unsigned int i)
+{
+	const struct vregs *v = voice(i);
+	struct vstate *st = &vstate[i];
+
+	st->dir_ptr = voice_srcn_pointer(i, v);
+	st->pitch_reg = voice_pitch(v);
+	st->voll = v->voll;
+	st->volr = v->volr;
+
+	st->adsr = v->adsr1 & ADSR1_USE_ADSR;
+	st->env_rate[ENV_ATTACK] = (v->adsr1 & ADSR1_ATTACK_RATE_MASK) * 2 + 1;
+	st->env_rate[ENV_DECAY] = 0x10 + ((v->adsr1 >> ADSR1_DECAY_RATE_SHIFT)
+						& ADSR1_DECAY_RATE_MASK);
+	st->env_rate[ENV_SUSTAIN] = v->adsr2 & ADSR2_SUSTAIN_RATE_MASK;
+	st->gain = v->gain;
+	st->sustain_level = ((st->adsr) ? v->adsr2 : v->gain)
+				>> ADSR2_SUSTAIN_LEVEL_SHIFT;
+}
+
+/* The directory entry is only needed at key-on and at the end of a block,
+ * and nothing can write ARAM between here and there, so only read it then.
+ */
+static uint16_t voice_next_brr_addr(const struct vstate * const st)
+{
+	return read_aram_word(st->srcn_ptr);
+}
+
+/* Everything up to the point where the voice is ready to be interpolated.
+ * None of this depends on any other voice, so all of the voices are prepared
+ * before any of them are run.
+ */
+static void voice_prepare(const unsigned int i)
 {
-	struct vregs *v = voice(i);
 	struct vstate *st = &vstate[i];
 	const uint8_t bit = (1U << i);
-	int16_t sample;
+
+	if (unlikely(vdirty & bit)) {
+		voice_decode(i);
+		vdirty &= ~bit;
+	}
 
 	/* VCLOCK: cycle 1 */
 
-	st->srcn_ptr = voice_srcn_pointer(i, v);
+	st->srcn_ptr = st->dir_ptr;
 
 	/* VCLOCK: cycle 2 */
 
@@ -960,14 +1349,13 @@ static struct sample voice_run(const unsigned int i)
 	if (!st->attack_delay) {
 		st->srcn_ptr += 2;
 	}
-	st->next_brr_addr = read_aram_word(st->srcn_ptr);
 
 	/* TODO: read envelope 0 */
 
 	/* VCLOCK: cycle 3a */
 
 	/* XXX: pitch-read should be split over the two cycles */
-	st->pitch = voice_pitch(v);
+	st->pitch = st->pitch_reg;
 
 	/* VCLOCK: cycle 3b */
 	st->brr_hdr = read_aram_byte(st->brr_addr);
@@ -975,14 +1363,13 @@ static struct sample voice_run(const unsigned int i)
 
 	/* VCLOCK: cycle 3c */
 
-	if (regs[REG_PMON] & bit) {
-		/* TODO: pitch mod with previous voice */
-		//say(WARN, "pitch-mod on voice %u", i);
-	}
+	/* PMON is applied in voice_run() once the previous voice's output is
+	 * known, nothing uses the pitch before then
+	 */
 
 	if (st->attack_delay) {
 		if (st->attack_delay == 5) {
-			st->brr_addr = st->next_brr_addr;
+			st->brr_addr = voice_next_brr_addr(st);
 			st->brr_off = 1;
 			st->buf_pos = 0;
 			st->brr_hdr = 0;
@@ -998,37 +1385,77 @@ static struct sample voice_run(const unsigned int i)
 		st->pitch = 0;
 		st->env = 0;
 	}
+}
+
+__attribute__((always_inline))
+static inline int voice_interpolate(const dsp_tier_t tier,
+					const unsigned int i)
+{
+	struct vstate * const st = &vstate[i];
+
+	if (tier == DSP_TIER_PREVIEW)
+		return interpolate_linear(st);
+
+	switch (interp_mode) {
+	case DSP_INTERP_GAUSS:
+		return interpolate(st);
+	case DSP_INTERP_GAUSS_SIMD:
+		/* halves runs voices one by one, and gets the same answer */
+		if (tier == DSP_TIER_HALVES)
+			return interpolate(st);
+		return interp_simd[i];
+	case DSP_INTERP_LINEAR:
+		return interpolate_linear(st);
+	case DSP_INTERP_NONE:
+		return interpolate_none(st);
+	default:
+		unreachable();
+	}
+}
+
+__attribute__((always_inline))
+static inline struct sample voice_run(const dsp_tier_t tier,
+					const unsigned int i)
+{
+	struct vstate *st = &vstate[i];
+	const uint8_t bit = (1U << i);
+	int16_t sample;
 
-	if (st->env) {
+	if (unlikely(voice_mute & ~(pmon_mask >> 1) & bit)) {
+		/* OUTX reads back as zero */
+		st->out = 0;
+		st->env_out = st->env;
+		sample = 0;
+	} else if (st->env) {
 		if (regs[REG_NON] & bit) {
-			/* TODO: noise */
-			say(WARN, "noise sample");
-			sample = 0;
+			sample = noise_seq[noise_idx];
 		} else {
-			sample = interpolate(st);
+			sample = voice_interpolate(tier, i);
 		}
 
-		/* XXX: buffer this for later */
-		v->outx = sample >> 8;
+		/* OUTX, materialised by load() */
+		st->out = sample;
 
 		/* apply envelope */
 		sample = ((sample * st->env) >> 11) & ~1;
 
-		/* XXX: buffer this for later */
-		v->envx = (st->env >> 4);
+		/* ENVX, also materialised by load() */
+		st->env_out = st->env;
 	} else {
-		v->outx = 0;
-		v->envx = 0;
+		st->out = 0;
+		st->env_out = 0;
 		sample = 0;
 	}
 
+	vout[i] = sample;
+
 	/* output silence due to reset or end of sample eilence */
 	if (regs[REG_FLG] & FLG_SOFT_RESET || (st->brr_hdr & BRR_FLAGS) == BRR_END) {
 		st->env_mode = ENV_RELEASE;
 		st->env = 0;
 	}
 
-	if (!toggle) {
+	if (!toggle && ((kon | koff) & bit)) {
 		if (koff & bit) {
 			if (st->env_mode != ENV_RELEASE) {
 				// say(DEBUG, "V%u: key-off", i);
@@ -1040,12 +1467,13 @@ static struct sample voice_run(const unsigned int i)
 			// say(DEBUG, "V%u: key-on", i);
 
 			st->env_mode = ENV_ATTACK;
+			st->env_due = 0;
 			st->attack_delay = 5;
 		}
 	}
 
 	if (!st->attack_delay) {
-		run_envelope(st, v->adsr1, v->adsr2, v->gain);
+		run_envelope(st);
 		if (st->env_mode == ENV_RELEASE && st->env == 0)
 			return silence();
 	}
@@ -1058,7 +1486,7 @@ static struct sample voice_run(const unsigned int i)
 		if (st->brr_off >= BRR_BLOCK_SIZE) {
 			st->brr_addr += BRR_BLOCK_SIZE;
 			if (st->brr_hdr & BRR_END) {
-				st->brr_addr = st->next_brr_addr;
+				st->brr_addr = voice_next_brr_addr(st);
 				/* XXX: buffer */
 				regs[REG_ENDX] |= bit;
 			}
@@ -1066,7 +1494,10 @@ static struct sample voice_run(const unsigned int i)
 		}
 	}
 
-	/* apply pitch */
+	/* apply pitch, modulated by the previous voice */
+	if (unlikely(pmon_mask & bit)) {
+		st->pitch += ((vout[i - 1] >> 5) * st->pitch) >> 10;
+	}
 	st->interp_pos = (st->interp_pos & 0x3fff) + st->pitch;
 	if (st->interp_pos > 0x7fff)
 		st->interp_pos = 0x7fff;
@@ -1099,26 +1530,29 @@ static struct sample voice_run(const unsigned int i)
 	/* VCLOCK: cycle 9 */
 	/* TODO: expose ENVX */
 
-	return pan(sample, v->voll, v->volr);
+	if (unlikely(voice_mute & bit))
+		return silence();
+
+	return pan(sample, st->voll, st->volr);
 }
 
 __attribute__((always_inline))
 static inline uint16_t echo_read_l(void)
 {
-	return read_aram_word(echo_ptr + 0);
+	return echo_word_load(echo_ptr + 0);
 }
 
 __attribute__((always_inline))
 static inline uint16_t echo_read_r(void)
 {
-	return read_aram_word(echo_ptr + 2);
+	return echo_word_load(echo_ptr + 2);
 }
 
 __attribute__((always_inline))
 static inline void echo_write_l(const int16_t val)
 {
 	if (echo_enabled) {
-		write_aram_word(echo_ptr + 0, val);
+		echo_word_store(echo_ptr + 0, val);
 	}
 }
 
@@ -1126,51 +1560,106 @@ __attribute__((always_inline))
 static inline void echo_write_r(const int16_t val)
 {
 	if (echo_enabled) {
-		write_aram_word(echo_ptr + 2, val);
+		echo_word_store(echo_ptr + 2, val);
 	}
 }
 
-static inline void fir_write_l(const int16_t val)
+static inline void fir_write(const int16_t l, const int16_t r)
 {
-	echo_hist[(echo_hist_pos + 0) % ECHO_HIST_SIZE].left = val >> 1;
+	const struct sample s = {
+		.left = l >> 1,
+		.right = r >> 1,
+	};
+
+	echo_hist[echo_hist_pos] = s;
+	echo_hist[echo_hist_pos + ECHO_HIST_SIZE] = s;
 }
 
+typedef int16_t v16hi __attribute__((vector_size(16 * sizeof(int16_t))));
+typedef int32_t v16si __attribute__((vector_size(16 * sizeof(int32_t))));
+typedef int32_t v4si __attribute__((vector_size(4 * sizeof(int32_t))));
+typedef int32_t v2si __attribute__((vector_size(2 * sizeof(int32_t))));
 
-static inline void fir_write_r(const int16_t val)
-{
-	echo_hist[(echo_hist_pos + 0) % ECHO_HIST_SIZE].right = val >> 1;
-}
+/* FIR coefficients, each one duplicated so as to line up with the
+ * interleaved left/right history. Kept up to date by store().
+ */
+static v16si fir_coeff;
 
-static inline int16_t fir_read_l(const uint8_t depth)
+static void fir_coeff_update(const uint8_t i)
 {
-	return echo_hist[(echo_hist_pos + depth) % ECHO_HIST_SIZE].left;
-}
+	const int8_t coeff = regs[reg_coeff(i)];
 
-static inline int16_t fir_read_r(const uint8_t depth)
-{
-	return echo_hist[(echo_hist_pos + depth) % ECHO_HIST_SIZE].right;
+	fir_coeff[i * 2 + 0] = coeff;
+	fir_coeff[i * 2 + 1] = coeff;
 }
 
-static inline struct fat_sample calc_fir(const uint8_t i)
+/* All 8 taps for both channels as one multiply over the linear history,
+ * then fold the even (left) and odd (right) lanes down in to a pair.
+ */
+static inline struct fat_sample calc_fir(void)
 {
-	const int8_t coeff = regs[reg_coeff(i)];
+	v16hi hist;
+	v16si p;
+	v8si p8;
+	v4si p4;
+	v2si p2;
+
+	memcpy(&hist, &echo_hist[echo_hist_pos + 1], sizeof(hist));
+	p = (__builtin_convertvector(hist, v16si) * fir_coeff) >> 6;
+
+	p8 = __builtin_shufflevector(p, p, 0, 1, 2, 3, 4, 5, 6, 7)
+		+ __builtin_shufflevector(p, p, 8, 9, 10, 11, 12, 13, 14, 15);
+	p4 = __builtin_shufflevector(p8, p8, 0, 1, 2, 3)
+		+ __builtin_shufflevector(p8, p8, 4, 5, 6, 7);
+	p2 = __builtin_shufflevector(p4, p4, 0, 1)
+		+ __builtin_shufflevector(p4, p4, 2, 3);
 
 	return (struct fat_sample) {
-		.left = (fir_read_l(i + 1) * coeff) >> 6,
-		.right = (fir_read_r(i + 1) * coeff) >> 6,
+		.left = p2[0],
+		.right = p2[1],
 	};
 }
 
-/* Run 32 cycles */
-static struct sample next_sample(void)
+/* If echo can't be heard and doesn't feed back in to the echo buffer then
+ * there's no point running the FIR. The buffer is still read, so the history
+ * is correct if this changes, and still written, since the CPU can see it.
+ */
+__attribute__((pure))
+static bool echo_bypassed(void)
 {
-	struct sample main_out = silence();
-	struct sample echo_out = silence();
-	struct sample echo_sample;
-	struct fat_sample echo_in;
+	const bool muted = regs[REG_FLG] & FLG_MUTE;
+	const bool audible = evol_l || evol_r;
+	const bool feedback = regs[REG_EFB]
+				&& !(regs[REG_FLG] & FLG_ECHO_DISABLED);
+
+	return (muted || !audible) && !feedback;
+}
+
+static void globals_decode(void)
+{
+	mvol_l = regs[REG_MVOLL] << 4;
+	mvol_r = regs[REG_MVOLR] << 4;
+	evol_l = regs[REG_EVOLL] << 4;
+	evol_r = regs[REG_EVOLR] << 4;
+	echo_bypass = echo_bypassed();
+}
+
+/* Fidelity tiers, see dsp_tier_t. Each tier gets its own copy of the sample
+ * pipeline with the tier as a constant, so none of them pay for the others.
+ */
+static dsp_tier_t dsp_tier = DSP_TIER_FAST;
 
+/* The start of a sample, before any of the voices */
+__attribute__((always_inline))
+static inline void sample_begin(void)
+{
 	// say(DEBUG, "DSP 32 clocks");
 
+	if (unlikely(gdirty)) {
+		globals_decode();
+		gdirty = false;
+	}
+
 	/* poll KON/KOF every other sample */
 	toggle ^= 1;
 
@@ -1185,56 +1674,93 @@ static struct sample next_sample(void)
 
 	ctr_run();
 
-	/* TODO: sample noise */
+	if (ctr_read(regs[REG_FLG] & FLG_NOISE_RATE_MASK)) {
+		if (++noise_idx == NOISE_PERIOD)
+			noise_idx = 0;
+	}
+}
+
+/* Run voices [first, last) and blend them in to the main and echo mixes */
+__attribute__((always_inline))
+static inline void mix_voices(const dsp_tier_t tier,
+				const unsigned int first,
+				const unsigned int last,
+				struct sample * const main_out,
+				struct sample * const echo_out)
+{
+	/* no point mixing voices in to an echo buffer that won't be written */
+	const uint8_t echo_voices = (regs[REG_FLG] & FLG_ECHO_DISABLED)
+					? 0 : eon;
 
 	/* We run each voice all the way through in sequence and each one
 	 * outputs a sample, then we gather up and blend all those samples
 	 * together and do all the final steps to produce the output sample.
+	 * The halves tier prepares each voice right before it runs instead,
+	 * which comes to the same thing without the SIMD interpolation.
 	 */
-	for (int i = 0; i < DSP_CHANNELS; i++) {
-		const struct sample vsample = voice_run(i);
+	if (tier != DSP_TIER_HALVES) {
+		for (unsigned int i = first; i < last; i++) {
+			voice_prepare(i);
+		}
 
-		main_out = sample_blend(main_out, vsample);
-		if (eon & (1U << i)) {
-			echo_out = sample_blend(echo_out, vsample);
+		if (tier == DSP_TIER_FAST
+				&& interp_mode == DSP_INTERP_GAUSS_SIMD) {
+			interpolate_simd(interp_simd);
 		}
 	}
 
-	/* --cyc22 */
-	if (++echo_hist_pos >= ECHO_HIST_SIZE) {
-		echo_hist_pos = 0;
-	}
+	for (unsigned int i = first; i < last; i++) {
+		struct sample vsample;
 
-	echo_ptr = (esa * 0x100 + echo_offset);
+		if (tier == DSP_TIER_HALVES)
+			voice_prepare(i);
+
+		vsample = voice_run(tier, i);
 
-	/* read left channel of echo buffer */
-	fir_write_l(echo_read_l());
+		stems[i] = vsample;
+		if (voice_mute & (1U << i))
+			continue;
 
-	/* FIR step 0 */
-	echo_in = calc_fir(0);
+		*main_out = sample_blend(*main_out, vsample);
+		if (echo_voices & (1U << i)) {
+			*echo_out = sample_blend(*echo_out, vsample);
+		}
+	}
+}
 
-	/* --cyc23 */
-	/* FIR steps 1, 2 */
-	echo_in = sample_accumulate(echo_in, calc_fir(1));
-	echo_in = sample_accumulate(echo_in, calc_fir(2));
+/* Everything after the voices: echo, and the final mix */
+__attribute__((always_inline))
+static inline struct sample sample_finish(const dsp_tier_t tier,
+					const struct sample main_out,
+					struct sample echo_out)
+{
+	struct sample echo_sample;
 
-	/* read right channel of echo buffer */
-	fir_write_r(echo_read_r());
+	/* --cyc22 */
+	if (++echo_hist_pos >= ECHO_HIST_SIZE) {
+		echo_hist_pos = 0;
+	}
 
+	echo_ptr = (esa * 0x100 + echo_offset);
 
-	/* --cyc24 */
-	/* FIR steps 3, 4, 5 */
-	echo_in = sample_accumulate(echo_in, calc_fir(3));
-	echo_in = sample_accumulate(echo_in, calc_fir(4));
-	echo_in = sample_accumulate(echo_in, calc_fir(5));
+	/* read left and right channels of echo buffer */
+	const uint16_t echo_l = echo_read_l();
+	const uint16_t echo_r = echo_read_r();
+	fir_write(echo_l, echo_r);
 
-	/* --cyc25 */
-	/* FIR steps 6,7 */
-	echo_in = sample_accumulate(echo_in, calc_fir(6));
-	echo_in = sample_accumulate(echo_in, calc_fir(7));
-	echo_sample = sample_clamp(echo_in);
-	echo_sample.left &= ~1;
-	echo_sample.right &= ~1;
+	/* --cyc23 - --cyc25 */
+	/* FIR steps 0 - 7
+	 * The right channel is read midway through the left channel's FIR on
+	 * the real thing, but only the last tap sees the newest sample.
+	 */
+	if (tier == DSP_TIER_PREVIEW || echo_bypass) {
+		echo_sample = silence();
+	} else {
+		echo_sample = sample_clamp(calc_fir());
+		echo_sample.left &= ~1;
+		echo_sample.right &= ~1;
+	}
+	stems[DSP_CHANNELS] = echo_sample;
 
 	/* TODO: knock off low bit */
 
@@ -1242,8 +1768,8 @@ static struct sample next_sample(void)
 
 	/* --cyc26 */
 	/* blend echo into left output sample */
-	int l = sample_scale(main_out.left, regs[REG_MVOLL] << 4)
-		+ sample_scale(echo_sample.left, regs[REG_EVOLL] << 4);
+	int l = sample_scale(main_out.left, mvol_l)
+		+ sample_scale(echo_sample.left, evol_l);
 
 	/* calculate echo feedback term and buffer it */
 	echo_out = sample_blend_scale8(echo_out, echo_sample, regs[REG_EFB]);
@@ -1252,12 +1778,11 @@ static struct sample next_sample(void)
 
 	/* ---cyc27 */
 	/* misc */
-	/* TODO: PMON */
 	/* echo */
 
 	/* blend echo into right output sample */
-	int r = sample_scale(main_out.right, regs[REG_MVOLR] << 4)
-		+ sample_scale(echo_sample.right, regs[REG_EVOLR] << 4);
+	int r = sample_scale(main_out.right, mvol_r)
+		+ sample_scale(echo_sample.right, evol_r);
 
 	/* check global muting */
 	if (regs[REG_FLG] & FLG_MUTE) {
@@ -1280,6 +1805,7 @@ static struct sample next_sample(void)
 	esa = regs[REG_ESA];
 	if (!echo_offset) {
 		echo_length = (regs[REG_EDL] & 0xf) * 0x800;
+		echo_ring_reclaim();
 	}
 	echo_offset += 4;
 	if (echo_offset >= echo_length)
@@ -1295,43 +1821,588 @@ static struct sample next_sample(void)
 	/* write right echo */
 	echo_write_r(echo_out.right);
 
+	if ((echo_l | echo_r) == 0
+			&& (!echo_enabled || (echo_out.left | echo_out.right) == 0)
+			&& (uint16_t)(echo_ptr - ring.base) < ring.len) {
+		echo_quiet++;
+	} else {
+		echo_quiet = 0;
+	}
+
 	return (struct sample) {
 		.left = clamp16(l),
 		.right = clamp16(r),
 	};
 }
 
-static unsigned long cycs;
-
-__attribute__((destructor))
-static void dtor(void)
+/* Run 32 cycles */
+static struct sample sample_fast(void)
+{
+	struct sample main_out = silence();
+	struct sample echo_out = silence();
+
+	sample_begin();
+	mix_voices(DSP_TIER_FAST, 0, DSP_CHANNELS, &main_out, &echo_out);
+	return sample_finish(DSP_TIER_FAST, main_out, echo_out);
+}
+
+/* As above but with linear interpolation and no echo */
+static struct sample sample_preview(void)
+{
+	struct sample main_out = silence();
+	struct sample echo_out = silence();
+
+	sample_begin();
+	mix_voices(DSP_TIER_PREVIEW, 0, DSP_CHANNELS, &main_out, &echo_out);
+	return sample_finish(DSP_TIER_PREVIEW, main_out, echo_out);
+}
+
+/* The halves tier runs each sample in two goes, one at each 16 cycle clock,
+ * so CPU writes made in the first half of a sample are seen by the voices
+ * in the second. On the real thing voices 0-4 start in the first half, 5-7
+ * and the echo in the second. That's as fine as it gets: within a half,
+ * every voice sees the registers as they were at the start of it, where the
+ * real thing reads each one at its own cycle.
+ */
+#define FIRST_HALF 5
+static struct {
+	bool begun;
+	struct sample main_out;
+	struct sample echo_out;
+} halves;
+
+static void sample_halves_begin(void)
+{
+	halves.main_out = silence();
+	halves.echo_out = silence();
+
+	sample_begin();
+	mix_voices(DSP_TIER_HALVES, 0, FIRST_HALF,
+			&halves.main_out, &halves.echo_out);
+	halves.begun = true;
+}
+
+static struct sample sample_halves(void)
+{
+	/* the first half can be missed, coming out of idle say */
+	if (!halves.begun)
+		sample_halves_begin();
+
+	halves.begun = false;
+
+	mix_voices(DSP_TIER_HALVES, FIRST_HALF, DSP_CHANNELS,
+			&halves.main_out, &halves.echo_out);
+	return sample_finish(DSP_TIER_HALVES, halves.main_out, halves.echo_out);
+}
+
+static struct sample next_sample(void)
+{
+	switch (dsp_tier) {
+	case DSP_TIER_FAST:
+		return sample_fast();
+	case DSP_TIER_HALVES:
+		return sample_halves();
+	case DSP_TIER_PREVIEW:
+		return sample_preview();
+	default:
+		unreachable();
+	}
+}
+
+/* Nothing can make a sound until the CPU does something: every voice is
+ * released and silent, no key-on is pending, and the echo buffer and history
+ * are all zero. The last is known from echo_quiet having seen a full pass
+ * through the buffer plus the length of the history, all while the ring was
+ * watched so the CPU can't have written anything behind our back.
+ *
+ * In that state every sample is zero and the only things which change are
+ * the counters, the echo position and the KON/KOFF toggle. So we stop
+ * running samples and catch those up in idle_leave() once the CPU writes to
+ * a DSP register or touches the echo buffer.
+ */
+static bool quiescent(void)
+{
+	const unsigned int pass = (echo_length) ? echo_length / 4 : 1;
+
+	if (echo_quiet < pass + ECHO_HIST_SIZE)
+		return false;
+
+	/* any pending changes to the echo buffer position */
+	if (esa != regs[REG_ESA]
+			|| echo_length != (regs[REG_EDL] & 0xf) * 0x800)
+		return false;
+
+	if (kon || regs[REG_KON])
+		return false;
+
+	for (int i = 0; i < DSP_CHANNELS; i++) {
+		const struct vstate * const st = &vstate[i];
+
+		if (st->env || st->env_mode != ENV_RELEASE || st->attack_delay)
+			return false;
+	}
+
+	return true;
+}
+
+static void idle_leave(void)
+{
+	const unsigned long n = idle_skipped;
+
+	if (!idle)
+		return;
+
+	toggle ^= n & 1;
+
+	noise_advance(ctr_hits(regs[REG_FLG] & FLG_NOISE_RATE_MASK, n));
+	ctr_skip(n);
+
+	echo_hist_pos = (echo_hist_pos + n) % ECHO_HIST_SIZE;
+	if (echo_length) {
+		const unsigned int pass = echo_length / 4;
+
+		echo_offset = (echo_offset + 4 * (n % pass)) % echo_length;
+	}
+
+	idle = false;
+	idle_skipped = 0;
+}
+
+static unsigned long cycs;
+
+/* frames at DSP_HZ to render, then to fade out over, before stopping */
+#define DEFAULT_LENGTH (DSP_HZ * 60UL)
+static unsigned long length = DEFAULT_LENGTH;
+static unsigned long fade;
+static unsigned long nr_frames;
+
+atomic_bool _dsp_done;
+
+__attribute__((destructor))
+static void dtor(void)
 {
 	printf("%lu dsp cycles\n", cycs);
 }
 
-#define SECONDS 60
-__attribute__((noinline))
-void _dsp_run32(void)
+/* Output is gathered in to blocks of OUT_BLOCK frames per stream, which are
+ * then either written out as they are or run through the resampler first.
+ * Normally the only stream is the mix, in stem mode there's one for each
+ * voice and one for the echo return.
+ */
+#define OUT_BLOCK 256
+struct out_stream {
+	sink_t *sink;
+	resample_t *resampler;
+	int16_t *resampled;
+	int16_t blk[OUT_BLOCK * 2];
+};
+
+static struct {
+	/* file names are based on this, out.wav, stems.wav etc. if NULL */
+	const char *name;
+	/* everything's written to each of these */
+	sink_type_t sink[SINK_NR];
+	unsigned int nr_sinks;
+	int fd;
+	unsigned int rate;
+	resample_quality_t quality;
+	dsp_stems_t stems;
+	unsigned int nr_streams;
+	unsigned int nr;
+	/* frames flushed so far */
+	unsigned long pos;
+	bool open;
+	bool failed;
+	/* every stream's frames side by side, for DSP_STEMS_MULTI */
+	int16_t *interleaved;
+	struct out_stream stream[DSP_STEMS];
+} out = {
+	.sink = {SINK_WAV},
+	.nr_sinks = 1,
+};
+
+__attribute__((cold))
+static bool stream_open(struct out_stream *s,
+			const char *name,
+			const unsigned int rate,
+			const unsigned int channels)
+{
+	if (rate != DSP_HZ) {
+		s->resampler = resample_new(DSP_HZ, rate, out.quality);
+		if (s->resampler == NULL)
+			return false;
+
+		s->resampled = malloc(resample_max_out(s->resampler, OUT_BLOCK)
+					* 2 * sizeof(s->resampled[0]));
+		if (s->resampled == NULL)
+			return false;
+	}
+
+	if (name != NULL) {
+		s->sink = sink_new_tee(out.sink, out.nr_sinks, name, out.fd,
+					rate, channels);
+		if (s->sink == NULL)
+			return false;
+	}
+
+	return true;
+}
+
+__attribute__((cold))
+static bool stream_close(struct out_stream *s)
 {
-	const struct sample sample = next_sample();
-	static unsigned int nr_samples;
-	static wav_t *wav;
+	const bool ret = sink_close(s->sink);
 
-	cycs += 32;
+	resample_free(s->resampler);
+	free(s->resampled);
+	*s = (struct out_stream){};
+
+	return ret;
+}
+
+__attribute__((cold))
+static bool out_release(void);
 
-	if (unlikely(wav == NULL)) {
-		wav = wav_create("out.wav");
+__attribute__((cold,pure))
+static bool out_has_sink(const sink_type_t type)
+{
+	for (unsigned int i = 0; i < out.nr_sinks; i++) {
+		if (out.sink[i] == type)
+			return true;
 	}
 
-	if (!wav_write_samples16(wav, sample.arr, 2)) {
-		abort();
+	return false;
+}
+
+__attribute__((cold))
+static bool out_open(void)
+{
+	const unsigned int rate = (out.rate) ? out.rate : DSP_HZ;
+	const char * const pfx = (out.name) ? out.name : "";
+	const char * const sep = (out.name) ? "." : "";
+	char name[PATH_MAX];
+
+	out.open = true;
+	out.pos = 0;
+
+	switch (out.stems) {
+	case DSP_STEMS_OFF:
+		out.nr_streams = 1;
+		snprintf(name, sizeof(name), "%s",
+			(out.name) ? out.name : "out");
+		if (!stream_open(&out.stream[0], name, rate, 2))
+			goto err;
+		break;
+	case DSP_STEMS_MULTI:
+		out.nr_streams = DSP_STEMS;
+		snprintf(name, sizeof(name), "%s%sstems", pfx, sep);
+		for (unsigned int i = 0; i < DSP_STEMS; i++) {
+			if (!stream_open(&out.stream[i], (i) ? NULL : name,
+						rate, DSP_STEMS * 2))
+				goto err;
+		}
+
+		/* every stream produces the same number of frames */
+		out.interleaved = malloc(((out.stream[0].resampler)
+				? resample_max_out(out.stream[0].resampler,
+							OUT_BLOCK)
+				: OUT_BLOCK) * DSP_STEMS * 2
+				* sizeof(out.interleaved[0]));
+		if (out.interleaved == NULL)
+			goto err;
+		break;
+	case DSP_STEMS_SPLIT:
+		if (out_has_sink(SINK_RAW)) {
+			say(ERR, "dsp: can't split stems down one stream");
+			goto err;
+		}
+
+		out.nr_streams = DSP_STEMS;
+		for (unsigned int i = 0; i < DSP_STEMS; i++) {
+			if (i < DSP_CHANNELS)
+				snprintf(name, sizeof(name), "%s%sstem-%u",
+						pfx, sep, i);
+			else
+				snprintf(name, sizeof(name), "%s%sstem-echo",
+						pfx, sep);
+
+			if (!stream_open(&out.stream[i], name, rate, 2))
+				goto err;
+		}
+		break;
+	default:
+		unreachable();
 	}
 
-	if (++nr_samples >= 32000 * SECONDS) {
-		if (!wav_close(wav))
-			abort();
-		exit(0);
+	return true;
+
+err:
+	out_release();
+	return false;
+}
+
+typedef float v16sf __attribute__((vector_size(16 * sizeof(float))));
+
+/* Scale nr frames, the first being frame pos of the render, by the fade out,
+ * which goes linearly from full volume at length to silence at length + fade,
+ * eight frames at a time.
+ */
+static void fade_block(int16_t blk[static OUT_BLOCK * 2],
+			const unsigned int nr,
+			const unsigned long pos)
+{
+	static_assert(!(OUT_BLOCK % 8), "fade works in 8 frame steps");
+	const v16sf frame = {0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7};
+	const float step = 1.0f / fade;
+
+	for (unsigned int i = 0; i < nr; i += 8) {
+		const float left = (float)(long)(length + fade - (pos + i));
+		v16sf gain = (left - frame) * step;
+		v16hi in;
+
+		/* frames before the fade starts, or after the end */
+		for (unsigned int j = 0; j < 16; j++) {
+			gain[j] = (gain[j] > 1.0f) ? 1.0f : gain[j];
+			gain[j] = (gain[j] < 0.0f) ? 0.0f : gain[j];
+		}
+
+		memcpy(&in, &blk[i * 2], sizeof(in));
+		in = __builtin_convertvector(
+				__builtin_convertvector(in, v16sf) * gain,
+				v16hi);
+		memcpy(&blk[i * 2], &in, sizeof(in));
+	}
+}
+
+/* Hand stream i's frames on, or put them in place to go out with the rest */
+static bool out_emit(const unsigned int i,
+			const int16_t *frames,
+			const unsigned int nr)
+{
+	struct out_stream * const s = &out.stream[i];
+
+	if (out.interleaved == NULL)
+		return sink_write(s->sink, frames, nr * 2);
+
+	for (unsigned int j = 0; j < nr; j++) {
+		int16_t * const f = &out.interleaved[
+				(j * out.nr_streams + i) * 2];
+
+		f[0] = frames[j * 2 + 0];
+		f[1] = frames[j * 2 + 1];
+	}
+
+	return true;
+}
+
+static bool out_flush(void)
+{
+	const unsigned int nr_in = out.nr;
+	const unsigned long pos = out.pos;
+	const bool fading = fade && pos + nr_in > length;
+	unsigned int nr = nr_in;
+
+	out.nr = 0;
+	out.pos += nr_in;
+
+	for (unsigned int i = 0; i < out.nr_streams; i++) {
+		struct out_stream * const s = &out.stream[i];
+		const int16_t *frames = s->blk;
+
+		if (unlikely(fading))
+			fade_block(s->blk, nr_in, pos);
+
+		if (s->resampler != NULL) {
+			nr = resample_run(s->resampler, s->blk, nr_in,
+						s->resampled);
+			frames = s->resampled;
+		}
+
+		if (!out_emit(i, frames, nr))
+			return false;
+	}
+
+	if (out.interleaved != NULL) {
+		return sink_write(out.stream[0].sink, out.interleaved,
+						nr * out.nr_streams * 2);
+	}
+
+	return true;
+}
+
+/* What's still in the resamplers once the last block has gone in */
+__attribute__((cold))
+static bool out_tail(void)
+{
+	unsigned int nr = 0;
+
+	for (unsigned int i = 0; i < out.nr_streams; i++) {
+		struct out_stream * const s = &out.stream[i];
+
+		if (s->resampler == NULL)
+			return true;
+
+		nr = resample_flush(s->resampler, s->resampled);
+		if (!out_emit(i, s->resampled, nr))
+			return false;
+	}
+
+	if (out.interleaved != NULL && nr) {
+		return sink_write(out.stream[0].sink, out.interleaved,
+						nr * out.nr_streams * 2);
+	}
+
+	return true;
+}
+
+/* What a voice, or the echo return, contributes to the final mix, give or
+ * take clamping.
+ */
+static struct sample stem_sample(const unsigned int i)
+{
+	const struct sample s = stems[i];
+	const bool echo = (i == DSP_CHANNELS);
+
+	if (regs[REG_FLG] & FLG_MUTE)
+		return silence();
+
+	return sample_clamp((struct fat_sample) {
+		.left = sample_scale(s.left, (echo) ? evol_l : mvol_l),
+		.right = sample_scale(s.right, (echo) ? evol_r : mvol_r),
+	});
+}
+
+static inline void out_put(const unsigned int i, const struct sample sample)
+{
+	int16_t * const f = &out.stream[i].blk[out.nr * 2];
+
+	f[0] = sample.left;
+	f[1] = sample.right;
+}
+
+static inline bool out_frame(const struct sample mix)
+{
+	if (likely(out.stems == DSP_STEMS_OFF)) {
+		out_put(0, mix);
+	} else {
+		for (unsigned int i = 0; i < DSP_STEMS; i++) {
+			out_put(i, stem_sample(i));
+		}
+	}
+
+	if (++out.nr < OUT_BLOCK)
+		return true;
+
+	return out_flush();
+}
+
+/* Without flushing, as when opening fails part way, some have no sink */
+__attribute__((cold))
+static bool out_release(void)
+{
+	bool ret = true;
+
+	for (unsigned int i = 0; i < DSP_STEMS; i++) {
+		ret &= stream_close(&out.stream[i]);
+	}
+
+	free(out.interleaved);
+	out.interleaved = NULL;
+	out.nr_streams = 0;
+	out.open = false;
+
+	return ret;
+}
+
+__attribute__((cold))
+static bool out_close(void)
+{
+	bool ret = out_flush() && out_tail();
+
+	ret &= out_release();
+
+	return ret;
+}
+
+static bool write_silence(void)
+{
+	while (idle_frames) {
+		unsigned int nr = OUT_BLOCK - out.nr;
+
+		if (idle_frames < nr)
+			nr = idle_frames;
+
+		for (unsigned int i = 0; i < out.nr_streams; i++) {
+			memset(&out.stream[i].blk[out.nr * 2], 0,
+				nr * 2 * sizeof(out.stream[i].blk[0]));
+		}
+		out.nr += nr;
+		idle_frames -= nr;
+
+		if (out.nr == OUT_BLOCK && !out_flush())
+			return false;
 	}
+
+	return true;
+}
+
+static void run16(void)
+{
+	if (idle)
+		return;
+
+	sample_halves_begin();
+}
+
+/* The render is over, for better or worse. Close everything and let the CPU
+ * know it can stop.
+ */
+__attribute__((cold))
+static void finish(bool ok)
+{
+	ok = ok && write_silence();
+	ok &= out_close();
+	ok &= _dsp_log_end(log_seen);
+
+	out.failed = !ok;
+	atomic_store_explicit(&_dsp_done, true, memory_order_release);
+}
+
+#define IDLE_CHUNK 1024
+__attribute__((noinline))
+static void run32(void)
+{
+	/* when pipelined, the CPU can be a little way past the end */
+	if (unlikely(dsp_done()))
+		return;
+
+	cycs += 32;
+
+	if (unlikely(!out.open) && !out_open())
+		goto err;
+
+	if (idle) {
+		idle_skipped++;
+		if (++idle_frames >= IDLE_CHUNK && !write_silence())
+			goto err;
+	} else {
+		const struct sample sample = next_sample();
+
+		if (unlikely(idle_frames) && !write_silence())
+			goto err;
+
+		if (!out_frame(sample))
+			goto err;
+
+		idle = quiescent();
+	}
+
+	if (++nr_frames >= length + fade)
+		finish(true);
+
+	return;
+err:
+	finish(false);
 }
 
 static void dump_dir(void)
@@ -1377,26 +2448,57 @@ static void init(void)
 	dump_regs();
 	dump_dir();
 	ctr_init();
-}
+	gauss4_init();
+	noise_init();
+	noise_idx = 0;
+
+	/* ARAM has just been restored underneath us */
+	ring.len = 0;
+	_dsp_watch.len = 0;
+	echo_quiet = 0;
+	idle = false;
+	idle_skipped = 0;
+	idle_frames = 0;
+
+	/* and everything else starts over, as it would in a new process */
+	memset(vstate, 0, sizeof(vstate));
+	memset(vout, 0, sizeof(vout));
+	memset(stems, 0, sizeof(stems));
+	memset(echo_hist, 0, sizeof(echo_hist));
+	echo_hist_pos = 0;
+	kon = koff = 0;
+	toggle = false;
+	esa = eon = 0;
+	echo_enabled = false;
+	echo_offset = echo_length = echo_ptr = 0;
+	halves.begun = false;
+	nr_frames = 0;
+	out.failed = false;
+	atomic_store_explicit(&_dsp_done, false, memory_order_relaxed);
+
+	vdirty = 0xff;
+	gdirty = true;
+	pmon_mask = regs[REG_PMON] & ~1U;
 
-__attribute__((cold))
-void dsp_restore(const uint8_t saved[static 0x80])
-{
-	memcpy(regs, saved, sizeof(regs));
-	init();
-}
+	for (int i = 0; i < DSP_CHANNELS; i++) {
+		const struct vregs *v = voice(i);
+		struct vstate *st = &vstate[i];
 
-__attribute__((cold))
-void dsp_reset(void)
-{
-	memset(regs, 0, sizeof(regs));
-	init();
+		st->out = (int8_t)v->outx << 8;
+		st->env_out = v->envx << 4;
+	}
+
+	for (int i = 0; i < DSP_CHANNELS; i++) {
+		fir_coeff_update(i);
+	}
 }
 
 static void store(const uint8_t addr, const uint8_t byte)
 {
 	const uint8_t prev = regs[addr];
 
+	idle_leave();
+
 	if (byte != prev) {
 		mmio_trace("dsp store $%02x -> %s", byte, dsp_reg_name(addr));
 	}
@@ -1411,11 +2513,58 @@ static void store(const uint8_t addr, const uint8_t byte)
 	}
 
 	regs[addr] = byte;
+
+	switch (addr & 0x0f) {
+	case VREG_ADSR1:
+	case VREG_ADSR2:
+	case VREG_GAIN:
+		vstate[addr >> 4].env_due = 0;
+		/* fall through */
+	case VREG_VOLL:
+	case VREG_VOLR:
+	case VREG_PLO:
+	case VREG_PHI:
+	case VREG_SRCN:
+		vdirty |= 1U << (addr >> 4);
+		break;
+	case VREG_ENVX:
+		vstate[addr >> 4].env_out = byte << 4;
+		break;
+	case VREG_OUTX:
+		vstate[addr >> 4].out = (int8_t)byte << 8;
+		break;
+	case VREG_COEF:
+		fir_coeff_update(addr >> 4);
+		break;
+	case 0x0c:
+	case 0x0d:
+		if (addr == REG_DIR)
+			vdirty = 0xff;
+		if (addr == REG_PMON)
+			pmon_mask = byte & ~1U;
+		gdirty = true;
+		break;
+	default:
+		break;
+	}
 }
 
 static inline uint8_t load(const uint8_t addr)
 {
-	const uint8_t byte = regs[addr];
+	const struct vstate * const st = &vstate[addr >> 4];
+	uint8_t byte;
+
+	switch (addr & 0x0f) {
+	case VREG_ENVX:
+		byte = st->env_out >> 4;
+		break;
+	case VREG_OUTX:
+		byte = st->out >> 8;
+		break;
+	default:
+		byte = regs[addr];
+		break;
+	}
 
 	// say(TRACE, "dsp  load %s -> $%02x", dsp_reg_name(addr), byte);
 
@@ -1437,6 +2586,502 @@ static uint8_t open_bus(const uint8_t addr)
 	return 0xff;
 }
 
+/* Pipelined mode: the CPU and DSP each get their own thread, connected by a
+ * queue of everything the CPU does that the DSP can see, in the order that it
+ * does them: register stores, ARAM stores, and the clocks which tell the DSP
+ * to run. The clocks stand in for timestamps. The DSP has its own copy of
+ * ARAM, so it only ever sees the CPU's writes as of the clock it's on.
+ *
+ * Whenever the CPU needs to see something that the DSP has done, that's ENDX,
+ * ENVX, OUTX and the echo buffer, it waits for the DSP to drain the queue.
+ */
+#define PIPE_SIZE	(1U << 16)
+#define PIPE_MASK	(PIPE_SIZE - 1)
+#define PIPE_BATCH	256
+
+typedef enum {
+	EV_RUN16,
+	EV_RUN32,
+	EV_STORE,
+	EV_ARAM,
+} dsp_ev_t;
+
+struct dsp_event {
+	uint8_t type;
+	uint8_t byte;
+	uint16_t addr;
+};
+static_assert(sizeof(struct dsp_event) == 4, "DSP event size");
+
+bool _dsp_pipelined;
+bool _dsp_aram_hooked;
+
+static struct {
+	/* written by the CPU thread */
+	_Atomic unsigned int head __attribute__((aligned(64)));
+
+	/* written by the DSP thread, once everything before it is done */
+	_Atomic unsigned int tail __attribute__((aligned(64)));
+
+	/* CPU thread only: our copies of head and tail, and of the DSP
+	 * registers as far as the CPU is concerned
+	 */
+	unsigned int cpu_head __attribute__((aligned(64)));
+	unsigned int cpu_tail;
+	uint8_t regs[0x80];
+
+	/* CPU thread only: while growing, _dsp_watch is the echo buffer the
+	 * DSP may have written since it was last caught up with, and room is
+	 * how much further it can go before wrapping around
+	 */
+	unsigned int room;
+	bool growing;
+
+	/* Either side sleeps here when it's got nothing to do: the DSP when
+	 * it's run out of events, the CPU when the queue is full or it wants
+	 * the DSP to catch up to wake_at.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t drained;
+	atomic_bool dsp_waiting;
+	atomic_bool cpu_waiting;
+	_Atomic unsigned int wake_at;
+
+	bool wanted;
+	atomic_bool stop;
+	pthread_t thread;
+	struct dsp_event ev[PIPE_SIZE];
+} dq = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.filled = PTHREAD_COND_INITIALIZER,
+	.drained = PTHREAD_COND_INITIALIZER,
+};
+
+/* DSP thread: a CPU write to ARAM */
+static void aram_store(const uint16_t addr, const uint8_t byte)
+{
+	const uint16_t off = addr - ring.base;
+
+	ram[addr] = byte;
+
+	if (unlikely(off < ring.len)) {
+		uint16_t * const word = &echo_ring[off >> 1];
+
+		idle_leave();
+
+		if (off & 1) {
+			*word = (*word & 0x00ff) | (byte << 8);
+		} else {
+			*word = (*word & 0xff00) | byte;
+		}
+
+		echo_quiet = 0;
+	}
+}
+
+static void pipe_apply(const struct dsp_event ev)
+{
+	switch ((dsp_ev_t)ev.type) {
+	case EV_RUN16:
+		run16();
+		break;
+	case EV_RUN32:
+		run32();
+		break;
+	case EV_STORE:
+		store(ev.addr, ev.byte);
+		break;
+	case EV_ARAM:
+		aram_store(ev.addr, ev.byte);
+		break;
+	default:
+		unreachable();
+	}
+}
+
+/* DSP thread: sleep until the CPU has pushed past tail, or wants us to stop.
+ * Whoever's pushing only wakes us once a batch, or when it needs us to
+ * catch up.
+ */
+static void pipe_wait_filled(const unsigned int tail)
+{
+	pthread_mutex_lock(&dq.lock);
+	atomic_store(&dq.dsp_waiting, true);
+
+	while (atomic_load(&dq.head) == tail && !atomic_load(&dq.stop))
+		pthread_cond_wait(&dq.filled, &dq.lock);
+
+	atomic_store(&dq.dsp_waiting, false);
+	pthread_mutex_unlock(&dq.lock);
+}
+
+/* DSP thread: everything before tail is done, tell the CPU if it's waiting
+ * for that
+ */
+static void pipe_drained(const unsigned int tail)
+{
+	atomic_store_explicit(&dq.tail, tail, memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_load_explicit(&dq.cpu_waiting, memory_order_relaxed)
+			&& (int)(tail - atomic_load(&dq.wake_at)) >= 0) {
+		pthread_mutex_lock(&dq.lock);
+		pthread_cond_signal(&dq.drained);
+		pthread_mutex_unlock(&dq.lock);
+	}
+}
+
+/* CPU thread: after pushing, or asking to stop */
+static void pipe_wake(void)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_load_explicit(&dq.dsp_waiting, memory_order_relaxed)) {
+		pthread_mutex_lock(&dq.lock);
+		pthread_cond_signal(&dq.filled);
+		pthread_mutex_unlock(&dq.lock);
+	}
+}
+
+/* CPU thread: sleep until the DSP has done everything before until */
+static void pipe_wait_drained(const unsigned int until)
+{
+	if ((int)(atomic_load(&dq.tail) - until) >= 0)
+		return;
+
+	/* it may be sitting on less than a batch */
+	pipe_wake();
+
+	pthread_mutex_lock(&dq.lock);
+	atomic_store(&dq.wake_at, until);
+	atomic_store(&dq.cpu_waiting, true);
+
+	while ((int)(atomic_load(&dq.tail) - until) < 0)
+		pthread_cond_wait(&dq.drained, &dq.lock);
+
+	atomic_store(&dq.cpu_waiting, false);
+	pthread_mutex_unlock(&dq.lock);
+}
+
+static void *pipe_thread(void *arg)
+{
+	unsigned int tail = 0;
+
+	while (true) {
+		const unsigned int head = atomic_load_explicit(&dq.head,
+							memory_order_acquire);
+
+		if (tail == head) {
+			if (atomic_load_explicit(&dq.stop, memory_order_relaxed))
+				return NULL;
+			pipe_wait_filled(tail);
+			continue;
+		}
+
+		do {
+			pipe_apply(dq.ev[tail++ & PIPE_MASK]);
+
+			if (!(tail % PIPE_BATCH))
+				pipe_drained(tail);
+		} while (tail != head);
+
+		pipe_drained(tail);
+	}
+}
+
+static void pipe_push(const dsp_ev_t type,
+			const uint16_t addr,
+			const uint8_t byte)
+{
+	const unsigned int head = dq.cpu_head;
+
+	while (unlikely(head - dq.cpu_tail >= PIPE_SIZE)) {
+		pipe_wait_drained(head - PIPE_SIZE + PIPE_BATCH);
+		dq.cpu_tail = atomic_load_explicit(&dq.tail,
+						memory_order_acquire);
+	}
+
+	dq.ev[head & PIPE_MASK] = (struct dsp_event) {
+		.type = type,
+		.byte = byte,
+		.addr = addr,
+	};
+
+	dq.cpu_head = head + 1;
+	atomic_store_explicit(&dq.head, head + 1, memory_order_release);
+
+	if (!(dq.cpu_head % PIPE_BATCH))
+		pipe_wake();
+}
+
+/* Wait for the DSP to catch up with the CPU. Until the next push, the CPU
+ * thread can look at, and touch, anything in the DSP.
+ */
+static void pipe_sync(void)
+{
+	pipe_wait_drained(dq.cpu_head);
+
+	dq.cpu_tail = dq.cpu_head;
+}
+
+/* The shortest range covering both a and b, which may wrap */
+__attribute__((const))
+static struct dsp_aram_watch watch_union(const struct dsp_aram_watch a,
+					const struct dsp_aram_watch b)
+{
+	const uint32_t a_b = (uint16_t)(b.base - a.base) + b.len;
+	const uint32_t b_a = (uint16_t)(a.base - b.base) + a.len;
+	const uint32_t from_a = (a_b > a.len) ? a_b : a.len;
+	const uint32_t from_b = (b_a > b.len) ? b_a : b.len;
+
+	if (!a.len)
+		return b;
+	if (!b.len)
+		return a;
+
+	if (from_a <= from_b) {
+		return (struct dsp_aram_watch) {
+			.base = a.base,
+			.len = (from_a > 0xffff) ? 0xffff : from_a,
+		};
+	} else {
+		return (struct dsp_aram_watch) {
+			.base = b.base,
+			.len = (from_b > 0xffff) ? 0xffff : from_b,
+		};
+	}
+}
+
+/* With the DSP caught up, the echo buffer is wherever it is now, and the
+ * furthest it can go before the CPU next writes ESA or EDL is wherever they
+ * say, carrying on from its current length until the next time it wraps.
+ */
+static void pipe_watch_all(void)
+{
+	const unsigned int len = (dq.regs[REG_EDL] & 0xf) * 0x800;
+	const struct dsp_aram_watch cur = {
+		.base = esa * 0x100,
+		.len = (echo_length) ? echo_length : 4,
+	};
+	const struct dsp_aram_watch next = {
+		.base = dq.regs[REG_ESA] * 0x100,
+		.len = (len > cur.len) ? len : cur.len,
+	};
+
+	dq.growing = false;
+	_dsp_watch = watch_union(cur, next);
+}
+
+/* CPU thread: one more sample pushed, so one more pair of echo words the
+ * DSP may write, unless that would take it round to the start.
+ */
+static inline void pipe_watch_grow(void)
+{
+	if (!dq.growing)
+		return;
+
+	if (unlikely(dq.room < 4)) {
+		pipe_watch_all();
+		return;
+	}
+
+	dq.room -= 4;
+	_dsp_watch.len += 4;
+}
+
+/* With the DSP caught up and ARAM up to date with it, the only thing it can
+ * go on to write is the echo buffer, from where it's got to. Unless it's
+ * about to move, in which case it could be anywhere pipe_watch_all() says.
+ */
+static void pipe_watch_reset(void)
+{
+	const unsigned int len = (echo_length) ? echo_length : 4;
+	unsigned int off = echo_offset;
+
+	/* idle_leave() will catch it up */
+	if (idle && echo_length)
+		off = (off + 4 * (idle_skipped % (len / 4))) % len;
+
+	if (esa != dq.regs[REG_ESA] || (!off && echo_length
+			!= (dq.regs[REG_EDL] & 0xf) * 0x800)) {
+		pipe_watch_all();
+		return;
+	}
+
+	_dsp_watch = (struct dsp_aram_watch) {
+		.base = esa * 0x100 + off,
+		.len = 0,
+	};
+	dq.room = len - off;
+	dq.growing = echo_enabled
+			|| !(dq.regs[REG_FLG] & FLG_ECHO_DISABLED);
+
+	/* and the sample it's part way through, in the halves tier */
+	pipe_watch_grow();
+}
+
+/* Bring the CPU's ARAM up to date with what the DSP has written since it was
+ * last caught up with, and hand the rest of the echo buffer back.
+ */
+static void pipe_sync_aram(void)
+{
+	pipe_sync();
+
+	for (uint16_t off = 0; off < _dsp_watch.len; off++) {
+		const uint16_t addr = _dsp_watch.base + off;
+		const uint16_t ring_off = addr - ring.base;
+
+		if (ring_off < ring.len) {
+			aram[addr] = echo_ring[ring_off >> 1]
+					>> ((ring_off & 1) * 8);
+		} else {
+			aram[addr] = ram[addr];
+		}
+	}
+
+	pipe_watch_reset();
+}
+
+__attribute__((cold))
+static void pipe_start(void)
+{
+	int err;
+
+	ram = malloc(sizeof(aram));
+	if (ram == NULL) {
+		say(ERR, "dsp: pipeline: out of memory");
+		goto out_serial;
+	}
+
+	/* the ring stays with the DSP, but from here on the CPU only watches
+	 * what the DSP writes, so it has to start off with what's in it
+	 */
+	for (uint16_t off = 0; off < ring.len; off += 2) {
+		aram[ring.base + off + 0] = echo_ring[off >> 1] & 0xff;
+		aram[ring.base + off + 1] = echo_ring[off >> 1] >> 8;
+	}
+
+	memcpy(ram, aram, sizeof(aram));
+	memcpy(dq.regs, regs, sizeof(dq.regs));
+	atomic_store_explicit(&dq.head, 0, memory_order_relaxed);
+	atomic_store_explicit(&dq.tail, 0, memory_order_relaxed);
+	atomic_store_explicit(&dq.stop, false, memory_order_relaxed);
+	dq.cpu_head = dq.cpu_tail = 0;
+
+	_dsp_pipelined = true;
+	_dsp_aram_hooked = true;
+	pipe_watch_reset();
+
+	err = pthread_create(&dq.thread, NULL, pipe_thread, NULL);
+	if (err) {
+		say(ERR, "dsp: pipeline: pthread_create: %s", strerror(err));
+		goto out_free;
+	}
+
+	say(INFO, "dsp: pipelined");
+	return;
+
+out_free:
+	_dsp_pipelined = false;
+	_dsp_aram_hooked = false;
+	_dsp_watch = ring;
+	free(ram);
+out_serial:
+	ram = aram;
+}
+
+/* Whichever of the directory and echo buffer the registers point at, the DSP
+ * may read all of them in whichever tier the log is replayed in.
+ */
+static void log_see(const uint16_t base, const unsigned int len)
+{
+	for (unsigned int off = 0; off < len; off += 0x100) {
+		log_seen[(uint8_t)((base + off) >> 8)] = true;
+	}
+}
+
+static void log_see_regs(void)
+{
+	const unsigned int edl = (regs[REG_EDL] & 0xf) * 0x800;
+
+	log_see(regs[REG_DIR] * 0x100, 0x100 * 4);
+	log_see(regs[REG_ESA] * 0x100, (edl) ? edl : 4);
+}
+
+/* init() has just let go of the echo ring, so ARAM is all there is */
+__attribute__((cold))
+static void log_start(void)
+{
+	if (!_dsp_log_begin(regs, aram, length, fade))
+		return;
+
+	memset(log_seen, 0, sizeof(log_seen));
+	log_see_regs();
+	_dsp_aram_hooked = true;
+
+	if (dq.wanted)
+		say(INFO, "dsp: not pipelining while recording");
+}
+
+/* Once the DSP has caught up, and everything it has is done with */
+__attribute__((cold))
+static void pipe_stop(void)
+{
+	int err;
+
+	pipe_sync_aram();
+	atomic_store_explicit(&dq.stop, true, memory_order_relaxed);
+	pipe_wake();
+
+	err = pthread_join(dq.thread, NULL);
+	if (err)
+		say(ERR, "dsp: pipeline: pthread_join: %s", strerror(err));
+
+	_dsp_pipelined = false;
+	_dsp_watch = ring;
+	free(ram);
+	ram = aram;
+}
+
+void _dsp_aram_store(const uint16_t addr, const uint8_t byte)
+{
+	if (_dsp_logging) {
+		_dsp_log_aram(addr, byte);
+		return;
+	}
+
+	pipe_push(EV_ARAM, addr, byte);
+}
+
+void _dsp_run16(void)
+{
+	if (unlikely(_dsp_logging))
+		_dsp_log_clock(false);
+
+	if (likely(dsp_tier != DSP_TIER_HALVES))
+		return;
+
+	if (_dsp_pipelined) {
+		pipe_push(EV_RUN16, 0, 0);
+	} else {
+		run16();
+	}
+}
+
+void _dsp_run32(void)
+{
+	if (unlikely(_dsp_logging))
+		_dsp_log_clock(true);
+
+	if (_dsp_pipelined) {
+		pipe_push(EV_RUN32, 0, 0);
+		pipe_watch_grow();
+	} else {
+		run32();
+	}
+}
+
 void _dsp_store(const uint8_t addr, const uint8_t byte)
 {
 	if (unlikely(addr & 0x80)) {
@@ -1444,15 +3089,159 @@ void _dsp_store(const uint8_t addr, const uint8_t byte)
 		return;
 	}
 
-	store(addr & 0x7f, byte);
+	if (!_dsp_pipelined) {
+		store(addr & 0x7f, byte);
+
+		if (unlikely(_dsp_logging)) {
+			_dsp_log_store(addr, byte);
+			if (addr == REG_DIR || addr == REG_ESA
+					|| addr == REG_EDL)
+				log_see_regs();
+		}
+		return;
+	}
+
+	dq.regs[addr] = (addr == REG_ENDX) ? 0 : byte;
+	pipe_push(EV_STORE, addr, byte);
+
+	/* the echo buffer may be moving */
+	if (addr == REG_ESA || addr == REG_EDL) {
+		pipe_sync_aram();
+	} else if (addr == REG_FLG && !dq.growing
+			&& !(byte & FLG_ECHO_DISABLED)) {
+		/* it's been left at the start, wherever it's got to since */
+		pipe_watch_all();
+	}
 }
 
-__attribute__((pure))
 uint8_t _dsp_load(const uint8_t addr)
 {
 	if (unlikely(addr & 0x80)) {
 		return open_bus(addr);
 	}
 
-	return load(addr & 0x7f);
+	if (!_dsp_pipelined)
+		return load(addr & 0x7f);
+
+	switch (addr & 0x0f) {
+	case VREG_ENVX:
+	case VREG_OUTX:
+		break;
+	default:
+		if (addr != REG_ENDX)
+			return dq.regs[addr];
+		break;
+	}
+
+	pipe_sync();
+	return load(addr);
+}
+
+__attribute__((cold))
+void _dsp_aram_touch(void)
+{
+	if (_dsp_pipelined) {
+		pipe_sync_aram();
+		return;
+	}
+
+	idle_leave();
+	echo_ring_drop();
+	echo_quiet = 0;
+}
+
+__attribute__((cold))
+void dsp_set_interp(const dsp_interp_t mode)
+{
+	interp_mode = mode;
+}
+
+void dsp_set_output_rate(const unsigned int rate,
+			const resample_quality_t quality)
+{
+	out.rate = rate;
+	out.quality = quality;
+}
+
+void dsp_set_sinks(unsigned int nr;
+			const sink_type_t type[static nr],
+			unsigned int nr,
+			const int fd)
+{
+	xassert(nr && nr <= SINK_NR);
+
+	memcpy(out.sink, type, nr * sizeof(type[0]));
+	out.nr_sinks = nr;
+	out.fd = fd;
+}
+
+void dsp_set_output_name(const char *name)
+{
+	out.name = name;
+}
+
+void dsp_set_length(const unsigned long frames)
+{
+	length = frames;
+}
+
+void dsp_set_fade(const unsigned long frames)
+{
+	fade = frames;
+}
+
+void dsp_set_stems(const dsp_stems_t mode)
+{
+	out.stems = mode;
+}
+
+void dsp_set_mute(const uint8_t mask)
+{
+	voice_mute = mask;
+}
+
+void dsp_set_tier(const dsp_tier_t tier)
+{
+	dsp_tier = tier;
+}
+
+void dsp_set_pipelined(const bool on)
+{
+	dq.wanted = on;
+}
+
+__attribute__((cold))
+void dsp_restore(const uint8_t saved[static 0x80])
+{
+	memcpy(regs, saved, sizeof(regs));
+	init();
+	log_start();
+
+	if (dq.wanted && !_dsp_pipelined && !_dsp_logging)
+		pipe_start();
+}
+
+__attribute__((cold))
+void dsp_reset(void)
+{
+	memset(regs, 0, sizeof(regs));
+	init();
+	log_start();
+
+	if (dq.wanted && !_dsp_pipelined && !_dsp_logging)
+		pipe_start();
+}
+
+__attribute__((cold))
+bool dsp_finish(void)
+{
+	if (_dsp_pipelined)
+		pipe_stop();
+
+	/* the CPU stopped first */
+	if (!dsp_done())
+		finish(true);
+
+	_dsp_aram_hooked = false;
+	return !out.failed;
 }
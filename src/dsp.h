@@ -1,6 +1,58 @@
 #pragma once
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
 void _dsp_run32(void);
 
+/* Set once the render is over, whatever is clocking the DSP should stop and
+ * call dsp_finish().
+ */
+extern atomic_bool _dsp_done;
+
+__attribute__((always_inline))
+static inline bool dsp_done(void)
+{
+	return atomic_load_explicit(&_dsp_done, memory_order_relaxed);
+}
+
+/* the other 16 cycle clock, between calls to _dsp_run32() */
+void _dsp_run16(void);
+
 uint8_t _dsp_load(const uint8_t addr);
 void _dsp_store(const uint8_t addr, const uint8_t byte);
+
+/* A range of ARAM which the DSP is holding somewhere else. The CPU must call
+ * _dsp_aram_touch() before reading, writing or executing anything in it.
+ */
+struct dsp_aram_watch {
+	uint16_t base;
+	uint16_t len;
+};
+
+extern struct dsp_aram_watch _dsp_watch;
+
+__attribute__((always_inline))
+static inline bool dsp_aram_watched(const uint16_t addr)
+{
+	return (uint16_t)(addr - _dsp_watch.base) < _dsp_watch.len;
+}
+
+void _dsp_aram_touch(void);
+
+/* In pipelined mode, the DSP has its own copy of ARAM, and while recording a
+ * log every write might go in to it. Either way, the CPU must tell the DSP
+ * about every write.
+ */
+extern bool _dsp_pipelined;
+extern bool _dsp_aram_hooked;
+
+void _dsp_aram_store(const uint16_t addr, const uint8_t byte);
+
+__attribute__((always_inline))
+static inline void dsp_aram_written(const uint16_t addr, const uint8_t byte)
+{
+	if (_dsp_aram_hooked)
+		_dsp_aram_store(addr, byte);
+}
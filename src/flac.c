@@ -0,0 +1,1067 @@
+#include <spu-kit/flac.h>
+#include <spu-kit/bufwr.h>
+
+#include "fd.h"
+#include "system.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+/* Frames per block, what the reference encoder uses for 16-bit */
+#define BLOCK		4096U
+
+/* blocks queued up for the encoder thread */
+#define NR_BLOCKS	4
+
+#define MAX_CHANNELS	8
+#define BPS		16
+
+#define MAX_FIXED	4
+#define MAX_LPC		12
+#define MAX_PARTITION	8
+
+/* bits per quantised LPC coefficient, including the sign */
+#define QLP_PRECISION	14
+#define MAX_QLP_SHIFT	15
+
+#define MAX_RICE4	14
+#define MAX_RICE5	30
+
+#define OUT_BUF_SIZE	(256 * 1024)
+
+/* STREAMINFO, after "fLaC" and its metadata block header */
+#define STREAMINFO_OFF	8
+#define STREAMINFO_LEN	34
+
+typedef enum {
+	SUB_CONSTANT,
+	SUB_VERBATIM,
+	SUB_FIXED,
+	SUB_LPC,
+} sub_type_t;
+
+typedef enum {
+	CH_INDEPENDENT,
+	CH_LEFT_SIDE = 8,
+	CH_RIGHT_SIDE,
+	CH_MID_SIDE,
+} ch_assign_t;
+
+/* Stereo blocks try all four of left, right, side and mid */
+#define NR_CANDIDATES	4
+#define C_LEFT		0
+#define C_RIGHT		1
+#define C_SIDE		2
+#define C_MID		3
+
+/* One channel of a block, encoded however came out smallest */
+struct subframe {
+	unsigned long bits;
+	sub_type_t type;
+	unsigned int order;
+	unsigned int shift;
+	unsigned int part_order;
+	bool rice5;
+	int32_t qlp[MAX_LPC];
+	uint8_t rice[1U << MAX_PARTITION];
+	int32_t res[BLOCK];
+};
+
+/* Autocorrelation is worked out for all of these lags at once */
+#define LAGS		16
+typedef double v4df __attribute__((vector_size(4 * sizeof(double))));
+static_assert(MAX_LPC < LAGS, "not enough lags for the LPC order");
+
+struct bits {
+	uint8_t *buf;
+	size_t len;
+	uint64_t acc;
+	unsigned int nr;
+};
+
+struct flac_s {
+	/* Caller side: filling ring[head], while the encoder thread works on
+	 * the queued ones from tail onwards.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t drained;
+	pthread_t thread;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int queued;
+	unsigned int cur;
+	int err;
+	bool stop;
+
+	int fd;
+	unsigned int rate;
+	unsigned int channels;
+	bufwr_t *out;
+
+	/* encoder thread only */
+	uint32_t frame_nr;
+	uint64_t nr_frames;
+	unsigned long min_frame;
+	unsigned long max_frame;
+	unsigned int win_len;
+
+	unsigned int len[NR_BLOCKS];
+	int16_t ring[NR_BLOCKS][BLOCK * MAX_CHANNELS];
+
+	int32_t x[MAX_CHANNELS][BLOCK];
+	struct subframe *sub[MAX_CHANNELS];
+	struct subframe *spare;
+	struct subframe subs[MAX_CHANNELS + 1];
+
+	float window[BLOCK];
+	double wx[BLOCK + LAGS] __attribute__((aligned(32)));
+
+	uint8_t frame[MAX_CHANNELS * (BLOCK * (BPS + 1) / 8 + 64) + 64];
+};
+
+static uint8_t crc8_tab[256];
+static uint16_t crc16_tab[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+	for (unsigned int i = 0; i < 256; i++) {
+		unsigned int c8 = i;
+		unsigned int c16 = i << 8;
+
+		for (unsigned int j = 0; j < 8; j++) {
+			c8 = (c8 << 1) ^ ((c8 & 0x80) ? 0x07 : 0);
+			c16 = (c16 << 1) ^ ((c16 & 0x8000) ? 0x8005 : 0);
+		}
+
+		crc8_tab[i] = c8;
+		crc16_tab[i] = c16;
+	}
+}
+
+__attribute__((pure))
+static uint8_t crc8(size_t len;
+			const uint8_t buf[static len],
+			size_t len)
+{
+	uint8_t crc = 0;
+
+	for (size_t i = 0; i < len; i++)
+		crc = crc8_tab[crc ^ buf[i]];
+
+	return crc;
+}
+
+__attribute__((pure))
+static uint16_t crc16(size_t len;
+			const uint8_t buf[static len],
+			size_t len)
+{
+	uint16_t crc = 0;
+
+	for (size_t i = 0; i < len; i++)
+		crc = (crc << 8) ^ crc16_tab[(crc >> 8) ^ buf[i]];
+
+	return crc;
+}
+
+/* n is at most 32 */
+static inline void put_bits(struct bits *b,
+				const unsigned int n,
+				const uint32_t val)
+{
+	b->acc = (b->acc << n) | (val & ((UINT64_C(1) << n) - 1));
+	b->nr += n;
+
+	while (b->nr >= 8) {
+		b->nr -= 8;
+		b->buf[b->len++] = b->acc >> b->nr;
+	}
+}
+
+static inline void put_signed(struct bits *b,
+				const unsigned int n,
+				const int32_t val)
+{
+	put_bits(b, n, (uint32_t)val);
+}
+
+static void put_align(struct bits *b)
+{
+	if (b->nr)
+		put_bits(b, 8 - b->nr, 0);
+}
+
+/* frame numbers, coded the same way as UTF-8 */
+static void put_utf8(struct bits *b, const uint32_t val)
+{
+	unsigned int n;
+
+	if (val < 0x80) {
+		put_bits(b, 8, val);
+		return;
+	}
+
+	for (n = 2; n < 6 && val >= (1U << (5 * n + 1)); n++)
+		;
+
+	put_bits(b, 8, (0xff00U >> n) | (val >> (6 * (n - 1))));
+	for (unsigned int i = n - 1; i--; )
+		put_bits(b, 8, 0x80 | ((val >> (6 * i)) & 0x3f));
+}
+
+__attribute__((const))
+static inline uint32_t zigzag(const int32_t val)
+{
+	return ((uint32_t)val << 1) ^ (uint32_t)(val >> 31);
+}
+
+static void put_rice(struct bits *b, const unsigned int k, const int32_t val)
+{
+	const uint32_t u = zigzag(val);
+	uint32_t q = u >> k;
+
+	while (q >= 32) {
+		put_bits(b, 32, 0);
+		q -= 32;
+	}
+
+	if (q + 1 + k <= 32) {
+		put_bits(b, q + 1 + k, (UINT32_C(1) << k) | (u & ((1U << k) - 1)));
+	} else {
+		put_bits(b, q + 1, 1);
+		put_bits(b, k, u);
+	}
+}
+
+/* Bits for cnt residuals adding up to sum with parameter k. Never less than
+ * it really takes, since sum >> k is at least the sum of each one >> k.
+ */
+__attribute__((const))
+static inline uint64_t rice_bits(const uint64_t sum,
+				const unsigned int cnt,
+				const unsigned int k)
+{
+	return (uint64_t)cnt * (k + 1) + (sum >> k);
+}
+
+static unsigned int rice_param(const uint64_t sum,
+				const unsigned int cnt,
+				uint64_t *bits)
+{
+	unsigned int k = 0;
+	uint64_t best;
+
+	while (k < MAX_RICE5 && ((uint64_t)cnt << (k + 1)) < sum)
+		k++;
+
+	best = rice_bits(sum, cnt, k);
+	if (k && rice_bits(sum, cnt, k - 1) < best) {
+		k--;
+		best = rice_bits(sum, cnt, k);
+	}
+
+	*bits = best;
+	return k;
+}
+
+/* Choose the partition order and parameters for sub->res, returns the bits
+ * the residual takes, including its header.
+ */
+static uint64_t rice_partition(struct subframe *sub, const unsigned int n)
+{
+	uint64_t sums[1U << MAX_PARTITION];
+	uint8_t params[1U << MAX_PARTITION];
+	uint64_t best = UINT64_MAX;
+	unsigned int max = 0;
+
+	while (max < MAX_PARTITION
+			&& !(n & ((2U << max) - 1))
+			&& (n >> (max + 1)) > sub->order)
+		max++;
+
+	for (unsigned int p = 0; p < (1U << max); p++) {
+		const unsigned int end = (p + 1) * (n >> max);
+		uint64_t sum = 0;
+
+		for (unsigned int i = (p) ? p * (n >> max) : sub->order;
+				i < end; i++)
+			sum += zigzag(sub->res[i]);
+
+		sums[p] = sum;
+	}
+
+	for (unsigned int po = max + 1; po--; ) {
+		const unsigned int nr = 1U << po;
+		uint64_t bits = 0;
+		bool rice5 = false;
+
+		for (unsigned int p = 0; p < nr; p++) {
+			const unsigned int cnt = (n >> po)
+						- ((p) ? 0 : sub->order);
+			uint64_t pbits;
+
+			params[p] = rice_param(sums[p], cnt, &pbits);
+			rice5 |= params[p] > MAX_RICE4;
+			bits += pbits;
+		}
+
+		bits += 2 + 4 + nr * ((rice5) ? 5 : 4);
+
+		if (bits < best) {
+			best = bits;
+			sub->part_order = po;
+			sub->rice5 = rice5;
+			memcpy(sub->rice, params, nr);
+		}
+
+		/* the next order down has half as many, twice as big */
+		for (unsigned int p = 0; p < nr / 2; p++)
+			sums[p] = sums[2 * p] + sums[2 * p + 1];
+	}
+
+	return best;
+}
+
+static void put_residual(struct bits *b,
+			const struct subframe *sub,
+			const unsigned int n)
+{
+	const unsigned int nr = 1U << sub->part_order;
+	const unsigned int len = n >> sub->part_order;
+
+	put_bits(b, 2, sub->rice5);
+	put_bits(b, 4, sub->part_order);
+
+	for (unsigned int p = 0; p < nr; p++) {
+		const unsigned int k = sub->rice[p];
+
+		put_bits(b, (sub->rice5) ? 5 : 4, k);
+
+		for (unsigned int i = (p) ? p * len : sub->order;
+				i < (p + 1) * len; i++)
+			put_rice(b, k, sub->res[i]);
+	}
+}
+
+static void fixed_residual(int32_t *res,
+			const int32_t *x,
+			const unsigned int n,
+			const unsigned int order)
+{
+	for (unsigned int i = order; i < n; i++) {
+		switch (order) {
+		case 0:
+			res[i] = x[i];
+			break;
+		case 1:
+			res[i] = x[i] - x[i - 1];
+			break;
+		case 2:
+			res[i] = x[i] - 2 * x[i - 1] + x[i - 2];
+			break;
+		case 3:
+			res[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+			break;
+		case 4:
+			res[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2]
+				- 4 * x[i - 3] + x[i - 4];
+			break;
+		default:
+			unreachable();
+		}
+	}
+}
+
+/* The fixed predictor whose residual has the smallest magnitude */
+__attribute__((pure))
+static unsigned int fixed_order(const int32_t *x, const unsigned int n)
+{
+	uint64_t err[MAX_FIXED + 1] = {};
+	unsigned int best = 0;
+
+	for (unsigned int i = MAX_FIXED; i < n; i++) {
+		const int64_t e0 = x[i];
+		const int64_t e1 = e0 - x[i - 1];
+		const int64_t e2 = e1 - (x[i - 1] - x[i - 2]);
+		const int64_t e3 = e2 - (x[i - 1] - 2 * x[i - 2] + x[i - 3]);
+		const int64_t e4 = e3 - (x[i - 1] - 3 * x[i - 2]
+					+ 3 * x[i - 3] - x[i - 4]);
+
+		err[0] += llabs(e0);
+		err[1] += llabs(e1);
+		err[2] += llabs(e2);
+		err[3] += llabs(e3);
+		err[4] += llabs(e4);
+	}
+
+	for (unsigned int i = 1; i <= MAX_FIXED; i++) {
+		if (err[i] < err[best])
+			best = i;
+	}
+
+	return best;
+}
+
+/* Tukey(0.5), as the reference encoder uses */
+static void make_window(float *w, const unsigned int n)
+{
+	const unsigned int taper = n / 4;
+
+	for (unsigned int i = 0; i < n; i++)
+		w[i] = 1.0f;
+
+	for (unsigned int i = 0; i < taper; i++) {
+		const float v = 0.5f - 0.5f * cosf(M_PI * i / taper);
+
+		w[i] = v;
+		w[n - 1 - i] = v;
+	}
+}
+
+/* autoc[lag] for every lag at once, one sample at a time: x has to be
+ * followed by LAGS zeros.
+ */
+static void autocorrelation(const double *x,
+				const unsigned int n,
+				double autoc[static LAGS])
+{
+	v4df acc[LAGS / 4] = {};
+
+	for (unsigned int i = 0; i < n; i++) {
+		for (unsigned int l = 0; l < LAGS / 4; l++) {
+			v4df v;
+
+			memcpy(&v, x + i + l * 4, sizeof(v));
+			acc[l] += x[i] * v;
+		}
+	}
+
+	memcpy(autoc, acc, sizeof(acc));
+}
+
+/* Levinson-Durbin: lp[order - 1] predicts x[i] from x[i - 1]... x[i - order]
+ * and err[order - 1] is what's left over. Returns the highest order found.
+ */
+static unsigned int lpc_coefs(const double autoc[static LAGS],
+				const unsigned int max_order,
+				double lp[static MAX_LPC][MAX_LPC],
+				double err[static MAX_LPC])
+{
+	double lpc[MAX_LPC];
+	double e = autoc[0];
+
+	for (unsigned int i = 0; i < max_order; i++) {
+		double r = -autoc[i + 1];
+		unsigned int j;
+
+		for (j = 0; j < i; j++)
+			r -= lpc[j] * autoc[i - j];
+		r /= e;
+
+		lpc[i] = r;
+		for (j = 0; j < (i >> 1); j++) {
+			const double tmp = lpc[j];
+
+			lpc[j] += r * lpc[i - 1 - j];
+			lpc[i - 1 - j] += r * tmp;
+		}
+		if (i & 1)
+			lpc[j] += lpc[j] * r;
+
+		e *= 1.0 - r * r;
+
+		for (j = 0; j <= i; j++)
+			lp[i][j] = -lpc[j];
+		err[i] = e;
+
+		if (e <= 0.0)
+			return i + 1;
+	}
+
+	return max_order;
+}
+
+/* The order where the coefficients stop paying for themselves, by the
+ * residual's expected size.
+ */
+__attribute__((pure))
+static unsigned int lpc_order(const double err[static MAX_LPC],
+				const unsigned int nr_orders,
+				const unsigned int n,
+				const unsigned int bps)
+{
+	const double scale = 0.5 / n;
+	double best = HUGE_VAL;
+	unsigned int order = 1;
+
+	for (unsigned int i = 0; i < nr_orders; i++) {
+		const unsigned int m = i + 1;
+		const double per = (err[i] > 0.0)
+			? fmax(0.5 * log2(scale * err[i]), 0.0)
+			: 0.0;
+		const double bits = per * (n - m) + m * (bps + QLP_PRECISION);
+
+		if (bits < best) {
+			best = bits;
+			order = m;
+		}
+	}
+
+	return order;
+}
+
+/* Quantise with the rounding error carried along, false if it can't be */
+static bool lpc_quantise(struct subframe *sub, const double *lp)
+{
+	const int32_t qmax = (1 << (QLP_PRECISION - 1)) - 1;
+	const int32_t qmin = -(1 << (QLP_PRECISION - 1));
+	double cmax = 0.0, error = 0.0;
+	int log2cmax, shift;
+
+	for (unsigned int i = 0; i < sub->order; i++)
+		cmax = fmax(cmax, fabs(lp[i]));
+
+	if (!(cmax > 0.0))
+		return false;
+
+	/* the biggest one only just fits in the precision, sign and all */
+	frexp(cmax, &log2cmax);
+	shift = QLP_PRECISION - 1 - log2cmax;
+	if (shift > MAX_QLP_SHIFT)
+		shift = MAX_QLP_SHIFT;
+	if (shift < 0)
+		return false;
+
+	for (unsigned int i = 0; i < sub->order; i++) {
+		long q;
+
+		error += lp[i] * (1 << shift);
+		q = lround(error);
+		if (q > qmax)
+			q = qmax;
+		else if (q < qmin)
+			q = qmin;
+		error -= q;
+
+		sub->qlp[i] = q;
+	}
+
+	sub->shift = shift;
+	return true;
+}
+
+static void lpc_residual(struct subframe *sub,
+			const int32_t *x,
+			const unsigned int n)
+{
+	for (unsigned int i = sub->order; i < n; i++) {
+		int64_t sum = 0;
+
+		for (unsigned int j = 0; j < sub->order; j++)
+			sum += (int64_t)sub->qlp[j] * x[i - j - 1];
+
+		sub->res[i] = x[i] - (int32_t)(sum >> sub->shift);
+	}
+}
+
+static void keep_if_smaller(flac_t *f, const unsigned int c)
+{
+	if (f->spare->bits < f->sub[c]->bits) {
+		struct subframe * const tmp = f->sub[c];
+
+		f->sub[c] = f->spare;
+		f->spare = tmp;
+	}
+}
+
+/* Work out the smallest subframe for x, as candidate c */
+static void analyse(flac_t *f,
+			const unsigned int c,
+			const int32_t *x,
+			const unsigned int n,
+			const unsigned int bps)
+{
+	struct subframe *sub = f->sub[c];
+	double autoc[LAGS], err[MAX_LPC];
+	double lp[MAX_LPC][MAX_LPC];
+	unsigned int i, nr_orders;
+
+	for (i = 1; i < n && x[i] == x[0]; i++)
+		;
+
+	if (i == n) {
+		sub->type = SUB_CONSTANT;
+		sub->order = 0;
+		sub->bits = 8 + bps;
+		return;
+	}
+
+	sub->type = SUB_VERBATIM;
+	sub->order = 0;
+	sub->bits = 8 + (unsigned long)n * bps;
+
+	if (n <= MAX_LPC)
+		return;
+
+	sub = f->spare;
+	sub->type = SUB_FIXED;
+	sub->order = fixed_order(x, n);
+	fixed_residual(sub->res, x, n, sub->order);
+	sub->bits = 8 + sub->order * bps + rice_partition(sub, n);
+	keep_if_smaller(f, c);
+
+	if (n != f->win_len) {
+		make_window(f->window, n);
+		f->win_len = n;
+	}
+
+	for (i = 0; i < n; i++)
+		f->wx[i] = x[i] * f->window[i];
+	memset(&f->wx[n], 0, LAGS * sizeof(f->wx[0]));
+
+	autocorrelation(f->wx, n, autoc);
+	if (!(autoc[0] > 0.0))
+		return;
+
+	nr_orders = lpc_coefs(autoc, MAX_LPC, lp, err);
+
+	sub = f->spare;
+	sub->type = SUB_LPC;
+	sub->order = lpc_order(err, nr_orders, n, bps);
+	if (!lpc_quantise(sub, lp[sub->order - 1]))
+		return;
+
+	lpc_residual(sub, x, n);
+	sub->bits = 8 + sub->order * bps + 4 + 5
+		+ sub->order * QLP_PRECISION + rice_partition(sub, n);
+	keep_if_smaller(f, c);
+}
+
+static void put_subframe(struct bits *b,
+			const struct subframe *sub,
+			const int32_t *x,
+			const unsigned int n,
+			const unsigned int bps)
+{
+	switch (sub->type) {
+	case SUB_CONSTANT:
+		put_bits(b, 8, 0);
+		put_signed(b, bps, x[0]);
+		break;
+	case SUB_VERBATIM:
+		put_bits(b, 8, 1 << 1);
+		for (unsigned int i = 0; i < n; i++)
+			put_signed(b, bps, x[i]);
+		break;
+	case SUB_FIXED:
+		put_bits(b, 8, (0x08 | sub->order) << 1);
+		for (unsigned int i = 0; i < sub->order; i++)
+			put_signed(b, bps, x[i]);
+		put_residual(b, sub, n);
+		break;
+	case SUB_LPC:
+		put_bits(b, 8, (0x20 | (sub->order - 1)) << 1);
+		for (unsigned int i = 0; i < sub->order; i++)
+			put_signed(b, bps, x[i]);
+		put_bits(b, 4, QLP_PRECISION - 1);
+		put_bits(b, 5, sub->shift);
+		for (unsigned int i = 0; i < sub->order; i++)
+			put_signed(b, QLP_PRECISION, sub->qlp[i]);
+		put_residual(b, sub, n);
+		break;
+	default:
+		unreachable();
+	}
+}
+
+__attribute__((const))
+static unsigned int rate_code(const unsigned int rate)
+{
+	switch (rate) {
+	case 88200:
+		return 1;
+	case 176400:
+		return 2;
+	case 192000:
+		return 3;
+	case 8000:
+		return 4;
+	case 16000:
+		return 5;
+	case 22050:
+		return 6;
+	case 24000:
+		return 7;
+	case 32000:
+		return 8;
+	case 44100:
+		return 9;
+	case 48000:
+		return 10;
+	case 96000:
+		return 11;
+	default:
+		break;
+	}
+
+	if (!(rate % 1000) && rate / 1000 < 0x100)
+		return 12;
+	if (rate < 0x10000)
+		return 13;
+	if (!(rate % 10) && rate / 10 < 0x10000)
+		return 14;
+
+	/* as in STREAMINFO */
+	return 0;
+}
+
+static void put_header(struct bits *b,
+			flac_t *f,
+			const unsigned int n,
+			const ch_assign_t assign)
+{
+	const unsigned int rc = rate_code(f->rate);
+	const unsigned int bc = (n == BLOCK) ? 12 : (n <= 0x100) ? 6 : 7;
+
+	put_bits(b, 16, 0xfff8);
+	put_bits(b, 4, bc);
+	put_bits(b, 4, rc);
+	put_bits(b, 4, assign);
+	put_bits(b, 3, 4);
+	put_bits(b, 1, 0);
+	put_utf8(b, f->frame_nr);
+
+	if (bc == 6)
+		put_bits(b, 8, n - 1);
+	else if (bc == 7)
+		put_bits(b, 16, n - 1);
+
+	if (rc == 12)
+		put_bits(b, 8, f->rate / 1000);
+	else if (rc == 13)
+		put_bits(b, 16, f->rate);
+	else if (rc == 14)
+		put_bits(b, 16, f->rate / 10);
+
+	put_bits(b, 8, crc8(b->buf, b->len));
+}
+
+/* Encode n frames of interleaved samples in to f->frame, returns its size */
+static size_t encode_frame(flac_t *f, const int16_t *in, const unsigned int n)
+{
+	struct bits b = {.buf = f->frame};
+	ch_assign_t assign = CH_INDEPENDENT | (f->channels - 1);
+	unsigned int src[MAX_CHANNELS], bps[MAX_CHANNELS];
+
+	for (unsigned int c = 0; c < f->channels; c++) {
+		for (unsigned int i = 0; i < n; i++)
+			f->x[c][i] = in[i * f->channels + c];
+
+		src[c] = c;
+		bps[c] = BPS;
+	}
+
+	if (f->channels == 2) {
+		unsigned long indep, ls, rs, ms;
+
+		for (unsigned int i = 0; i < n; i++) {
+			const int32_t l = f->x[C_LEFT][i];
+			const int32_t r = f->x[C_RIGHT][i];
+
+			f->x[C_SIDE][i] = l - r;
+			f->x[C_MID][i] = (l + r) >> 1;
+		}
+
+		for (unsigned int c = 0; c < NR_CANDIDATES; c++)
+			analyse(f, c, f->x[c], n, (c == C_SIDE) ? BPS + 1 : BPS);
+
+		indep = f->sub[C_LEFT]->bits + f->sub[C_RIGHT]->bits;
+		ls = f->sub[C_LEFT]->bits + f->sub[C_SIDE]->bits;
+		rs = f->sub[C_SIDE]->bits + f->sub[C_RIGHT]->bits;
+		ms = f->sub[C_MID]->bits + f->sub[C_SIDE]->bits;
+
+		if (ls < indep && ls <= rs && ls <= ms) {
+			assign = CH_LEFT_SIDE;
+			src[1] = C_SIDE;
+			bps[1] = BPS + 1;
+		} else if (rs < indep && rs <= ms) {
+			assign = CH_RIGHT_SIDE;
+			src[0] = C_SIDE;
+			bps[0] = BPS + 1;
+		} else if (ms < indep) {
+			assign = CH_MID_SIDE;
+			src[0] = C_MID;
+			src[1] = C_SIDE;
+			bps[1] = BPS + 1;
+		}
+	} else {
+		for (unsigned int c = 0; c < f->channels; c++)
+			analyse(f, c, f->x[c], n, BPS);
+	}
+
+	put_header(&b, f, n, assign);
+
+	for (unsigned int c = 0; c < f->channels; c++)
+		put_subframe(&b, f->sub[src[c]], f->x[src[c]], n, bps[c]);
+
+	put_align(&b);
+	put_bits(&b, 16, crc16(b.buf, b.len));
+
+	return b.len;
+}
+
+static void *encoder(void *arg)
+{
+	flac_t * const f = arg;
+
+	pthread_mutex_lock(&f->lock);
+
+	for (;;) {
+		unsigned int i;
+		bool failed;
+
+		while (!f->queued && !f->stop)
+			pthread_cond_wait(&f->filled, &f->lock);
+
+		if (!f->queued)
+			break;
+
+		i = f->tail;
+		failed = f->err;
+		pthread_mutex_unlock(&f->lock);
+
+		if (!failed) {
+			const size_t len = encode_frame(f, f->ring[i],
+							f->len[i]);
+
+			if (len < f->min_frame || !f->min_frame)
+				f->min_frame = len;
+			if (len > f->max_frame)
+				f->max_frame = len;
+
+			f->frame_nr++;
+			f->nr_frames += f->len[i];
+
+			failed = !bufwr_write(f->out, f->frame, len);
+		}
+
+		pthread_mutex_lock(&f->lock);
+
+		if (failed && !f->err)
+			f->err = errno;
+
+		f->tail = (f->tail + 1) % NR_BLOCKS;
+		f->queued--;
+		pthread_cond_signal(&f->drained);
+	}
+
+	pthread_mutex_unlock(&f->lock);
+	return NULL;
+}
+
+/* Hand over the block we're filling and wait for somewhere to put the next */
+__attribute__((nonnull(1),warn_unused_result))
+static bool submit(flac_t *f)
+{
+	int err;
+
+	pthread_mutex_lock(&f->lock);
+
+	f->len[f->head] = f->cur;
+	f->head = (f->head + 1) % NR_BLOCKS;
+	f->queued++;
+	pthread_cond_signal(&f->filled);
+
+	while (f->queued == NR_BLOCKS)
+		pthread_cond_wait(&f->drained, &f->lock);
+
+	err = f->err;
+	pthread_mutex_unlock(&f->lock);
+
+	f->cur = 0;
+
+	if (unlikely(err)) {
+		say(ERR, "flac: write: %s", strerror(err));
+		return false;
+	}
+
+	return true;
+}
+
+static void put_streaminfo(flac_t *f, uint8_t buf[static STREAMINFO_LEN])
+{
+	struct bits b = {.buf = buf};
+
+	put_bits(&b, 16, BLOCK);
+	put_bits(&b, 16, BLOCK);
+	put_bits(&b, 24, f->min_frame);
+	put_bits(&b, 24, f->max_frame);
+	put_bits(&b, 20, f->rate);
+	put_bits(&b, 3, f->channels - 1);
+	put_bits(&b, 5, BPS - 1);
+	put_bits(&b, 4, f->nr_frames >> 32);
+	put_bits(&b, 32, f->nr_frames);
+
+	/* no MD5 of the samples, which is allowed */
+	memset(buf + b.len, 0, STREAMINFO_LEN - b.len);
+}
+
+flac_t *flac_create(const char *fn,
+			const unsigned int rate,
+			const unsigned int channels)
+{
+	uint8_t hdr[STREAMINFO_OFF + STREAMINFO_LEN] = {
+		'f', 'L', 'a', 'C',
+		/* the last metadata block, and STREAMINFO */
+		0x80, 0, 0, STREAMINFO_LEN,
+	};
+	flac_t *f;
+	int err;
+
+	if (!channels || channels > MAX_CHANNELS) {
+		say(ERR, "%s: flac: %u channels, can only do 1 to %u",
+			fn, channels, MAX_CHANNELS);
+		goto out;
+	}
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL) {
+		say(ERR, "flac: out of memory");
+		goto out;
+	}
+
+	pthread_once(&crc_once, crc_init);
+
+	f->rate = rate;
+	f->channels = channels;
+	for (unsigned int i = 0; i < MAX_CHANNELS; i++)
+		f->sub[i] = &f->subs[i];
+	f->spare = &f->subs[MAX_CHANNELS];
+
+	f->fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (f->fd < 0) {
+		say(ERR, "%s: open: %s", fn, strerror(errno));
+		goto out_free;
+	}
+
+	f->out = bufwr_new(f->fd, OUT_BUF_SIZE);
+	if (f->out == NULL) {
+		say(ERR, "flac: out of memory");
+		goto out_close;
+	}
+
+	/* filled in properly on close */
+	put_streaminfo(f, hdr + STREAMINFO_OFF);
+	if (!bufwr_write(f->out, hdr, sizeof(hdr))) {
+		say(ERR, "%s: write: %s", fn, strerror(errno));
+		goto out_abort;
+	}
+
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->filled, NULL);
+	pthread_cond_init(&f->drained, NULL);
+
+	err = pthread_create(&f->thread, NULL, encoder, f);
+	if (err) {
+		say(ERR, "flac: pthread_create: %s", strerror(err));
+		goto out_destroy;
+	}
+
+	return f;
+
+out_destroy:
+	pthread_cond_destroy(&f->drained);
+	pthread_cond_destroy(&f->filled);
+	pthread_mutex_destroy(&f->lock);
+out_abort:
+	bufwr_abort(f->out);
+	goto out_free;
+out_close:
+	close(f->fd);
+out_free:
+	free(f);
+out:
+	return NULL;
+}
+
+__attribute__((nonnull(1),warn_unused_result))
+bool flac_write_samples16(size_t num;
+		flac_t *f,
+		const int16_t sample[static num],
+		size_t num)
+{
+	size_t frames = num / f->channels;
+
+	while (frames) {
+		const size_t take = (frames < BLOCK - f->cur)
+					? frames : BLOCK - f->cur;
+
+		memcpy(&f->ring[f->head][f->cur * f->channels], sample,
+			take * f->channels * sizeof(sample[0]));
+
+		f->cur += take;
+		sample += take * f->channels;
+		frames -= take;
+
+		if (f->cur == BLOCK && unlikely(!submit(f)))
+			return false;
+	}
+
+	return true;
+}
+
+__attribute__((nonnull(1),warn_unused_result))
+bool _flac_close(flac_t *f)
+{
+	uint8_t streaminfo[STREAMINFO_LEN];
+	bool ret = true;
+	int err;
+
+	if (f->cur && !submit(f))
+		ret = false;
+
+	pthread_mutex_lock(&f->lock);
+	f->stop = true;
+	pthread_cond_signal(&f->filled);
+	pthread_mutex_unlock(&f->lock);
+
+	err = pthread_join(f->thread, NULL);
+	if (unlikely(err)) {
+		say(ERR, "flac: pthread_join: %s", strerror(err));
+		ret = false;
+	}
+
+	if (ret && f->err) {
+		say(ERR, "flac: write: %s", strerror(f->err));
+		ret = false;
+	}
+
+	if (ret && !bufwr_flush(f->out)) {
+		say(ERR, "flac: write: %s", strerror(errno));
+		ret = false;
+	}
+
+	put_streaminfo(f, streaminfo);
+	if (ret && !fd_pwrite(f->fd, STREAMINFO_OFF, streaminfo,
+				sizeof(streaminfo))) {
+		say(ERR, "flac: write: %s", strerror(errno));
+		ret = false;
+	}
+
+	if (!bufwr_close(f->out, false))
+		ret = false;
+
+	pthread_cond_destroy(&f->drained);
+	pthread_cond_destroy(&f->filled);
+	pthread_mutex_destroy(&f->lock);
+	free(f);
+
+	return ret;
+}
@@ -2,10 +2,18 @@
 #include <spu-kit/apu.h>
 #include <spu-kit/spc700.h>
 #include <spu-kit/dsp.h>
+#include <spu-kit/dsp-log.h>
+#include <spu-kit/audition.h>
 
+#include "dsp-regs.h"
 #include "fd.h"
 #include "system.h"
 
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
@@ -40,66 +48,162 @@ static bool fill_buf(size_t len;
 	return true;
 }
 
-struct spc_file spc;
+/* The SPC, mapped straight from the file where it can be, and the file kept
+ * open for spc700_restore_file() if so, otherwise read in to spc_buf. Both
+ * last until unload().
+ */
+static const struct spc_file *spc;
+static struct spc_file spc_buf;
+static int spc_fd = -1;
+static void *spc_map;
+static size_t spc_map_len;
+
+/* whatever follows the SPC, hopefully an xid6 chunk */
+static const uint8_t *xid6;
+static uint8_t xid6_buf[0x10000];
+static size_t xid6_len;
+
+/* For pipes and the like. Only the first 64KiB after the SPC is kept. */
+__attribute__((cold))
+static bool read_spc(const char *fn, const int fd)
+{
+	ssize_t len;
+
+	if (!fill_buf(fd, (uint8_t *)&spc_buf, sizeof(spc_buf))) {
+		say(ERR, "%s: open: %s", fn, strerror(errno));
+		return false;
+	}
+
+	for (xid6_len = 0; xid6_len < sizeof(xid6_buf); xid6_len += len) {
+		len = read(fd, xid6_buf + xid6_len,
+				sizeof(xid6_buf) - xid6_len);
+		if (len < 0) {
+			say(ERR, "%s: read: %s", fn, strerror(errno));
+			return false;
+		} else if (!len) {
+			break;
+		}
+	}
+
+	spc = &spc_buf;
+	xid6 = xid6_buf;
+	return true;
+}
 
 __attribute__((cold))
 static bool load(const char *fn)
 {
-	bool ret = false;
+	struct stat st;
+	void *map;
 	int fd;
 
 	say(INFO, "load: %s", fn);
 
+	spc_fd = -1;
+	spc_map = NULL;
+
 	fd = open(fn, O_RDONLY);
 	if (fd < 0) {
 		say(ERR, "%s: open: %s", fn, strerror(errno));
-		goto out;
+		return false;
 	}
 
-	if (!fill_buf(fd, (uint8_t *)&spc, sizeof(spc))) {
-		say(ERR, "%s: open: %s", fn, strerror(errno));
+	if (fstat(fd, &st)) {
+		say(ERR, "%s: stat: %s", fn, strerror(errno));
 		goto out_close;
 	}
 
-	ret = true;
+	if (!S_ISREG(st.st_mode)) {
+		if (!read_spc(fn, fd))
+			goto out_close;
+		close(fd);
+		return true;
+	}
+
+	if ((size_t)st.st_size < sizeof(*spc)) {
+		say(ERR, "%s: too short for an SPC", fn);
+		goto out_close;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		say(ERR, "%s: mmap: %s", fn, strerror(errno));
+		goto out_close;
+	}
+
+	spc = map;
+	spc_fd = fd;
+	spc_map = map;
+	spc_map_len = st.st_size;
+	xid6 = (const uint8_t *)map + sizeof(*spc);
+	xid6_len = st.st_size - sizeof(*spc);
+	return true;
 
 out_close:
 	close(fd);
-out:
-	return ret;
+	return false;
+}
+
+__attribute__((cold))
+static void unload(void)
+{
+	if (spc_map != NULL && munmap(spc_map, spc_map_len))
+		say(WARN, "munmap: %s", strerror(errno));
+
+	if (spc_fd >= 0)
+		close(spc_fd);
+
+	spc = NULL;
+	spc_fd = -1;
+	spc_map = NULL;
+	xid6 = NULL;
+	xid6_len = 0;
 }
 
 __attribute__((cold))
 static void print_id666(void)
 {
 #if 1
-	say(INFO, "song title: %.*s", 32, spc.id666.txt.song_title);
-	say(INFO, "game title: %.*s", 32, spc.id666.txt.game_title);
-	say(INFO, "dumper: %.*s", 16, spc.id666.txt.dumper);
-	if (spc.id666.txt.comments[0] != '\0')
-		say(INFO, "comments: %.*s", 32, spc.id666.txt.comments);
-	say(INFO, "dump date: %.*s", 11, spc.id666.txt.dump_date);
-	say(INFO, "song length: %.*s secs", 3, spc.id666.txt.song_secs);
-	say(INFO, "fade length: %.*s msec", 5, spc.id666.txt.fade_msecs);
-	say(INFO, "artist: %.*s", 32, spc.id666.txt.artist);
-	say(INFO, "channel disables: 0x%.2x", spc.id666.txt.default_channel_disables);
-	say(INFO, "emulator: 0x%.2x", spc.id666.txt.dump_emulator);
+	say(INFO, "song title: %.*s", 32, spc->id666.txt.song_title);
+	say(INFO, "game title: %.*s", 32, spc->id666.txt.game_title);
+	say(INFO, "dumper: %.*s", 16, spc->id666.txt.dumper);
+	if (spc->id666.txt.comments[0] != '\0')
+		say(INFO, "comments: %.*s", 32, spc->id666.txt.comments);
+	say(INFO, "dump date: %.*s", 11, spc->id666.txt.dump_date);
+	say(INFO, "song length: %.*s secs", 3, spc->id666.txt.song_secs);
+	say(INFO, "fade length: %.*s msec", 5, spc->id666.txt.fade_msecs);
+	say(INFO, "artist: %.*s", 32, spc->id666.txt.artist);
+	say(INFO, "channel disables: 0x%.2x", spc->id666.txt.default_channel_disables);
+	say(INFO, "emulator: 0x%.2x", spc->id666.txt.dump_emulator);
 #endif
 #if 0
-	say(INFO, "song title: %.*s", 32, spc.id666.bin.song_title);
-	say(INFO, "game title: %.*s", 32, spc.id666.bin.game_title);
-	say(INFO, "dumper: %.*s", 16, spc.id666.bin.dumper);
-	if (spc.id666.bin.comments[0] != '\0')
-		say(INFO, "comments: %.*s", 32, spc.id666.bin.comments);
-	say(INFO, "dump date: 0x%.8x", spc.id666.bin.dump_date);
-	say(INFO, "song length: %.*s secs", 3, spc.id666.bin.song_secs);
-	say(INFO, "fade length: %.*s msec", 4, spc.id666.bin.fade_msecs);
-	say(INFO, "artist: %.*s", 32, spc.id666.bin.artist);
-	say(INFO, "channel disables: 0x%.2x", spc.id666.bin.default_channel_disables);
-	say(INFO, "emulator: 0x%.2x", spc.id666.bin.dump_emulator);
+	say(INFO, "song title: %.*s", 32, spc->id666.bin.song_title);
+	say(INFO, "game title: %.*s", 32, spc->id666.bin.game_title);
+	say(INFO, "dumper: %.*s", 16, spc->id666.bin.dumper);
+	if (spc->id666.bin.comments[0] != '\0')
+		say(INFO, "comments: %.*s", 32, spc->id666.bin.comments);
+	say(INFO, "dump date: 0x%.8x", spc->id666.bin.dump_date);
+	say(INFO, "song length: %.*s secs", 3, spc->id666.bin.song_secs);
+	say(INFO, "fade length: %.*s msec", 4, spc->id666.bin.fade_msecs);
+	say(INFO, "artist: %.*s", 32, spc->id666.bin.artist);
+	say(INFO, "channel disables: 0x%.2x", spc->id666.bin.default_channel_disables);
+	say(INFO, "emulator: 0x%.2x", spc->id666.bin.dump_emulator);
 #endif
 }
 
+/* the voices the tag says to leave out, if there is one */
+__attribute__((pure))
+static uint8_t default_mute(void)
+{
+	if (spc->hdr.id666_tag_status != SPC_ID666_TAGGED)
+		return 0;
+
+	if (id666_is_text(&spc->id666.txt))
+		return spc->id666.txt.default_channel_disables;
+
+	return spc->id666.bin.default_channel_disables;
+}
+
 static struct spc700_regs convert_regs(const struct spc_regs r)
 {
 	return (struct spc700_regs){
@@ -141,30 +245,681 @@ out:
 	return ret;
 }
 
+/* where to write the SPC's RAM before it runs, if anywhere */
+static const char *dump_fn;
+
 __attribute__((cold))
 static void setup_spc700(void)
 {
-	dump_ram(spc.ram, "aram.bin");
+	const struct spc700_regs regs = convert_regs(spc->regs);
+
+	if (dump_fn != NULL)
+		dump_ram(spc->ram, dump_fn);
 
-	spc700_restore(convert_regs(spc.regs),
-			spc.ram,
-			spc.extra_ram);
+	if (spc_map == NULL
+			|| !spc700_restore_file(regs, spc_fd, spc->extra_ram))
+		spc700_restore(regs, spc->ram, spc->extra_ram);
+
+	if (spc_fd >= 0) {
+		close(spc_fd);
+		spc_fd = -1;
+	}
 
-	apu_restore(apu_state_from_aram(spc.ram));
+	apu_restore(apu_state_from_aram(spc->ram));
 
-	dsp_restore(spc.dsp_regs);
+	dsp_restore(spc->dsp_regs);
 }
 
+/* from the command line, or -1 to use the ID666 tag */
+static int mute = -1;
+
+/* FILEs are DSP logs, not SPCs */
+static bool replay;
+
+/* from the command line in seconds, or -1 to use the tags */
+static double length_secs = -1;
+static double fade_secs = -1;
+
+#define DEFAULT_SECS 60
+
+/* tags, overridden by the command line, or a minute and no fade */
+__attribute__((cold))
+static void set_length(const struct spc_length tags)
+{
+	const unsigned long play = (length_secs >= 0)
+			? (unsigned long)(length_secs * DSP_HZ)
+			: (tags.play)
+				? tags.play * DSP_HZ / SPC_TICKS_HZ
+				: DEFAULT_SECS * DSP_HZ;
+	const unsigned long fade = (fade_secs >= 0)
+			? (unsigned long)(fade_secs * DSP_HZ)
+			: tags.fade * DSP_HZ / SPC_TICKS_HZ;
+
+	say(INFO, "length: %lu.%03lu secs, fade %lu.%03lu secs",
+		play / DSP_HZ, play % DSP_HZ * 1000 / DSP_HZ,
+		fade / DSP_HZ, fade % DSP_HZ * 1000 / DSP_HZ);
+
+	dsp_set_length(play);
+	dsp_set_fade(fade);
+}
+
+/* notes to play out of each FILE instead of running its driver */
+static struct audition_voice voices[8];
+static unsigned int nr_voices;
+
 static bool handle_file(const char *fn)
 {
+	bool ret;
+
+	if (replay) {
+		/* the log's own, where the command line doesn't say */
+		if (length_secs >= 0)
+			dsp_set_length((unsigned long)(length_secs * DSP_HZ));
+		if (fade_secs >= 0)
+			dsp_set_fade((unsigned long)(fade_secs * DSP_HZ));
+
+		dsp_set_mute((mute >= 0) ? mute : 0);
+		return dsp_log_replay(fn, length_secs < 0, fade_secs < 0);
+	}
+
 	if (!load(fn))
 		return false;
 
+	if (nr_voices) {
+		dsp_set_mute((mute >= 0) ? mute : 0);
+		ret = audition_run(spc->ram, spc->dsp_regs, voices, nr_voices);
+		goto out;
+	}
+
 	print_id666();
 
+	set_length(spc_length(spc, xid6, xid6_len));
+
+	dsp_set_mute((mute >= 0) ? mute : default_mute());
+
 	setup_spc700();
 
-	spc700_run_forever();
+	spc700_run();
+
+	ret = dsp_finish();
+out:
+	unload();
+	return ret;
+}
+
+/* foo/bar.spc -> bar */
+static void output_name(const char *fn, char name[static PATH_MAX])
+{
+	char buf[PATH_MAX];
+	char *dot;
+
+	snprintf(buf, sizeof(buf), "%s", fn);
+	snprintf(name, PATH_MAX, "%s", basename(buf));
+
+	dot = strrchr(name, '.');
+	if (dot != NULL && dot != name)
+		*dot = '\0';
+}
+
+struct output {
+	char *name;
+	const char *fn;
+};
+
+static int output_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct output *)a)->name,
+			((const struct output *)b)->name);
+}
+
+/* a/x.spc and b/x.spc would both go to x.wav, one over the other */
+__attribute__((cold))
+static bool check_output_names(const unsigned int nr,
+				char * const files[static nr])
+{
+	struct output *outs;
+	char name[PATH_MAX];
+	unsigned int i;
+	bool ret = true;
+
+	outs = calloc(nr, sizeof(*outs));
+	if (outs == NULL) {
+		say(ERR, "out of memory");
+		return false;
+	}
+
+	for (i = 0; i < nr; i++) {
+		output_name(files[i], name);
+
+		outs[i].fn = files[i];
+		outs[i].name = strdup(name);
+		if (outs[i].name == NULL) {
+			say(ERR, "out of memory");
+			ret = false;
+			goto out;
+		}
+	}
+
+	qsort(outs, nr, sizeof(*outs), output_cmp);
+
+	for (i = 1; i < nr; i++) {
+		if (strcmp(outs[i - 1].name, outs[i].name))
+			continue;
+
+		say(ERR, "%s and %s would both be output as %s, rename one",
+			outs[i - 1].fn, outs[i].fn, outs[i].name);
+		ret = false;
+	}
+
+out:
+	while (i--)
+		free(outs[i].name);
+	free(outs);
+	return ret;
+}
+
+__attribute__((cold))
+static void usage(void)
+{
+	printf("Usage: %s [OPTION]... FILE...\n", program_invocation_short_name);
+	printf("Render SPC files. With more than one FILE, each goes to its "
+		"own output named\n"
+		"after it, bar.wav for foo/bar.spc, rather than out.wav.\n\n");
+	printf("  -i, --interp=MODE     interpolation: gauss (default), simd, "
+		"linear, none\n");
+	printf("  -o, --output=SINKS    wav (default), flac, npy, raw for 16-bit "
+		"PCM to stdout,\n"
+		"                        stats for peak and loudness, or null; "
+		"several at once\n"
+		"                        with commas or more than one -o\n");
+	printf("  -n, --npy=OPTS        write .npy arrays: float32 (default) or "
+		"int16,\n"
+		"                        interleaved (default) or planar, and "
+		"window=MS to cut\n"
+		"                        them in to windows of MS each\n");
+	printf("  -r, --rate=HZ         resample output to HZ (default 32000)\n");
+	printf("  -q, --quality=TIER    resampler quality: fast, medium (default), "
+		"best\n");
+	printf("  -s, --stems=MODE      write each voice and the echo return "
+		"separately:\n"
+		"                        multi (stems.wav), split (stem-*.wav)\n");
+	printf("  -m, --mute=MASK       silence voices with their bit set in "
+		"MASK,\n"
+		"                        default is from the ID666 tag\n");
+	printf("  -t, --tier=TIER       fidelity: fast (default), halves, "
+		"preview\n");
+	printf("  -l, --length=SECS     play for SECS, default is from the "
+		"ID666 tag, or 60\n");
+	printf("  -f, --fade=SECS       then fade out over SECS, default is "
+		"from the ID666 tag\n");
+	printf("  -p, --pipeline        run the DSP on a separate thread\n");
+	printf("  -T, --realtime[=OPTS] pace output to real time, in periods of "
+		"period=FRAMES\n"
+		"                        (default 256) with up to periods=N "
+		"queued (default\n"
+		"                        4), and say how long each took to render "
+		"at the end\n");
+	printf("  -a, --audition=NOTE   play NOTE on the next voice with no "
+		"CPU, NOTE is a list of\n"
+		"                        srcn=N, pitch=P (0x1000 is 32kHz), "
+		"adsr=0xAADD, gain=G,\n"
+		"                        vol=V, voll=V, volr=V, echo to put it "
+		"through the\n"
+		"                        SPC's echo, and on=MS, off=MS\n");
+	printf("  -L, --record=LOG      log everything the CPU does to the DSP "
+		"in to LOG\n");
+	printf("  -R, --replay          FILEs are logs from --record, render "
+		"them\n"
+		"                        without the CPU\n");
+	printf("  -D, --dump-ram=FILE   write the SPC's 64KiB of RAM to FILE "
+		"before running it\n");
+	printf("  -h, --help            display this help and exit\n");
+}
+
+__attribute__((cold))
+static bool parse_interp(const char *str, dsp_interp_t *mode)
+{
+	static const struct {
+		const char *name;
+		dsp_interp_t mode;
+	} modes[] = {
+		{"gauss", DSP_INTERP_GAUSS},
+		{"simd", DSP_INTERP_GAUSS_SIMD},
+		{"linear", DSP_INTERP_LINEAR},
+		{"none", DSP_INTERP_NONE},
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(modes); i++) {
+		if (!strcmp(str, modes[i].name)) {
+			*mode = modes[i].mode;
+			return true;
+		}
+	}
+
+	say(ERR, "unknown interpolation mode: %s", str);
+	return false;
+}
+
+__attribute__((cold))
+static bool parse_quality(const char *str, resample_quality_t *quality)
+{
+	static const struct {
+		const char *name;
+		resample_quality_t quality;
+	} tiers[] = {
+		{"fast", RESAMPLE_FAST},
+		{"medium", RESAMPLE_MEDIUM},
+		{"best", RESAMPLE_BEST},
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(tiers); i++) {
+		if (!strcmp(str, tiers[i].name)) {
+			*quality = tiers[i].quality;
+			return true;
+		}
+	}
+
+	say(ERR, "unknown resampler quality: %s", str);
+	return false;
+}
+
+/* Adds type to the sinks unless it's there already */
+__attribute__((cold))
+static void add_sink(sink_type_t sink[static SINK_NR], unsigned int *nr,
+			const sink_type_t type)
+{
+	for (unsigned int i = 0; i < *nr; i++) {
+		if (sink[i] == type)
+			return;
+	}
+
+	sink[(*nr)++] = type;
+}
+
+/* A comma separated list, added to whatever's there */
+__attribute__((cold))
+static bool parse_sinks(char *str, sink_type_t sink[static SINK_NR],
+			unsigned int *nr)
+{
+	static const struct {
+		const char *name;
+		sink_type_t type;
+	} sinks[] = {
+		{"wav", SINK_WAV},
+		{"flac", SINK_FLAC},
+		{"npy", SINK_NPY},
+		{"raw", SINK_RAW},
+		{"stats", SINK_STATS},
+		{"null", SINK_NULL},
+	};
+	char *name;
+
+	while ((name = strsep(&str, ",")) != NULL) {
+		size_t i;
+
+		for (i = 0; i < ARRAY_SIZE(sinks); i++) {
+			if (!strcmp(name, sinks[i].name))
+				break;
+		}
+
+		if (i == ARRAY_SIZE(sinks)) {
+			say(ERR, "unknown output: %s", name);
+			return false;
+		}
+
+		add_sink(sink, nr, sinks[i].type);
+	}
+
+	return true;
+}
+
+/* The PCM gets stdout to itself, everything else we'd print there goes to
+ * stderr instead. Returns the fd for the PCM.
+ */
+__attribute__((cold))
+static int take_stdout(void)
+{
+	int fd;
+
+	fflush(stdout);
+
+	fd = dup(STDOUT_FILENO);
+	if (fd < 0) {
+		say(ERR, "dup: %s", strerror(errno));
+		return -1;
+	}
+
+	if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		say(ERR, "dup2: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+__attribute__((cold))
+static bool parse_tier(const char *str, dsp_tier_t *tier)
+{
+	static const struct {
+		const char *name;
+		dsp_tier_t tier;
+	} tiers[] = {
+		{"fast", DSP_TIER_FAST},
+		{"halves", DSP_TIER_HALVES},
+		{"preview", DSP_TIER_PREVIEW},
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(tiers); i++) {
+		if (!strcmp(str, tiers[i].name)) {
+			*tier = tiers[i].tier;
+			return true;
+		}
+	}
+
+	say(ERR, "unknown fidelity tier: %s", str);
+	return false;
+}
+
+__attribute__((cold))
+static bool parse_stems(const char *str, dsp_stems_t *mode)
+{
+	static const struct {
+		const char *name;
+		dsp_stems_t mode;
+	} modes[] = {
+		{"multi", DSP_STEMS_MULTI},
+		{"split", DSP_STEMS_SPLIT},
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(modes); i++) {
+		if (!strcmp(str, modes[i].name)) {
+			*mode = modes[i].mode;
+			return true;
+		}
+	}
+
+	say(ERR, "unknown stems mode: %s", str);
+	return false;
+}
+
+__attribute__((cold))
+static bool parse_mute(const char *str, int *mask)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(str, &end, 0);
+	if (errno || end == str || *end != '\0' || val > 0xff) {
+		say(ERR, "bad voice mask: %s", str);
+		return false;
+	}
+
+	*mask = val;
+	return true;
+}
+
+/* value of a NOTE sub-option, in [min, max] */
+__attribute__((cold))
+static bool parse_subopt(const char *what,
+			const char *key, const char *str,
+			const long min, const long max,
+			long *val)
+{
+	char *end;
+
+	if (str == NULL) {
+		say(ERR, "%s: %s needs a value", what, key);
+		return false;
+	}
+
+	errno = 0;
+	*val = strtol(str, &end, 0);
+	if (errno || end == str || *end != '\0' || *val < min || *val > max) {
+		say(ERR, "%s: bad %s: %s", what, key, str);
+		return false;
+	}
+
+	return true;
+}
+
+__attribute__((cold))
+static bool parse_note(char *str, struct audition_voice *v)
+{
+	enum {
+		OPT_SRCN,
+		OPT_PITCH,
+		OPT_ADSR,
+		OPT_GAIN,
+		OPT_VOL,
+		OPT_VOLL,
+		OPT_VOLR,
+		OPT_ECHO,
+		OPT_ON,
+		OPT_OFF,
+	};
+	char * const keys[] = {
+		[OPT_SRCN] = "srcn",
+		[OPT_PITCH] = "pitch",
+		[OPT_ADSR] = "adsr",
+		[OPT_GAIN] = "gain",
+		[OPT_VOL] = "vol",
+		[OPT_VOLL] = "voll",
+		[OPT_VOLR] = "volr",
+		[OPT_ECHO] = "echo",
+		[OPT_ON] = "on",
+		[OPT_OFF] = "off",
+		NULL,
+	};
+	bool adsr = false, gain = false;
+	long on = 0, off = 1000;
+	char *val;
+	long n;
+
+	/* full attack, sustain at full level forever */
+	*v = (struct audition_voice){
+		.pitch = 0x1000,
+		.adsr1 = 0x8f,
+		.adsr2 = 0xe0,
+		.voll = 0x40,
+		.volr = 0x40,
+	};
+
+	while (*str != '\0') {
+		const int opt = getsubopt(&str, keys, &val);
+
+		switch (opt) {
+		case OPT_SRCN:
+			if (!parse_subopt("audition", keys[opt], val,
+						0, 0xff, &n))
+				return false;
+			v->srcn = n;
+			break;
+		case OPT_PITCH:
+			if (!parse_subopt("audition", keys[opt], val,
+						0, 0x3fff, &n))
+				return false;
+			v->pitch = n;
+			break;
+		case OPT_ADSR:
+			if (!parse_subopt("audition", keys[opt], val,
+						0, 0xffff, &n))
+				return false;
+			v->adsr1 = (n >> 8) | ADSR1_USE_ADSR;
+			v->adsr2 = n & 0xff;
+			adsr = true;
+			break;
+		case OPT_GAIN:
+			if (!parse_subopt("audition", keys[opt], val,
+						0, 0xff, &n))
+				return false;
+			v->gain = n;
+			gain = true;
+			break;
+		case OPT_VOL:
+		case OPT_VOLL:
+		case OPT_VOLR:
+			if (!parse_subopt("audition", keys[opt], val,
+						-128, 127, &n))
+				return false;
+			if (opt != OPT_VOLR)
+				v->voll = n;
+			if (opt != OPT_VOLL)
+				v->volr = n;
+			break;
+		case OPT_ECHO:
+			v->echo = true;
+			break;
+		case OPT_ON:
+			if (!parse_subopt("audition", keys[opt], val,
+						0, LONG_MAX / DSP_HZ, &on))
+				return false;
+			break;
+		case OPT_OFF:
+			if (!parse_subopt("audition", keys[opt], val,
+						0, LONG_MAX / DSP_HZ, &off))
+				return false;
+			break;
+		default:
+			say(ERR, "audition: unknown option: %s", val);
+			return false;
+		}
+	}
+
+	/* GAIN only counts when ADSR is off */
+	if (gain && !adsr)
+		v->adsr1 = 0;
+
+	v->on = on * DSP_HZ / 1000;
+	v->off = off * DSP_HZ / 1000;
+	return true;
+}
+
+/* float32 or int16, interleaved or planar, and window=MS */
+__attribute__((cold))
+static bool parse_npy(char *str, struct npy_format *fmt)
+{
+	enum {
+		OPT_FLOAT32,
+		OPT_INT16,
+		OPT_INTERLEAVED,
+		OPT_PLANAR,
+		OPT_WINDOW,
+	};
+	char * const keys[] = {
+		[OPT_FLOAT32] = "float32",
+		[OPT_INT16] = "int16",
+		[OPT_INTERLEAVED] = "interleaved",
+		[OPT_PLANAR] = "planar",
+		[OPT_WINDOW] = "window",
+		NULL,
+	};
+	char *val;
+	long n;
+
+	while (*str != '\0') {
+		const int opt = getsubopt(&str, keys, &val);
+
+		switch (opt) {
+		case OPT_FLOAT32:
+			fmt->dtype = NPY_FLOAT32;
+			break;
+		case OPT_INT16:
+			fmt->dtype = NPY_INT16;
+			break;
+		case OPT_INTERLEAVED:
+			fmt->planar = false;
+			break;
+		case OPT_PLANAR:
+			fmt->planar = true;
+			break;
+		case OPT_WINDOW:
+			if (!parse_subopt("npy", keys[opt], val,
+						0, LONG_MAX / 192000, &n))
+				return false;
+			fmt->window_ms = n;
+			break;
+		default:
+			say(ERR, "npy: unknown option: %s", val);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* period=FRAMES and periods=N */
+__attribute__((cold))
+static bool parse_realtime(char *str, unsigned int *period,
+				unsigned int *nr_periods)
+{
+	enum {
+		OPT_PERIOD,
+		OPT_PERIODS,
+	};
+	char * const keys[] = {
+		[OPT_PERIOD] = "period",
+		[OPT_PERIODS] = "periods",
+		NULL,
+	};
+	char *val;
+	long n;
+
+	while (*str != '\0') {
+		const int opt = getsubopt(&str, keys, &val);
+
+		switch (opt) {
+		case OPT_PERIOD:
+			if (!parse_subopt("realtime", keys[opt], val,
+						1, 1 << 20, &n))
+				return false;
+			*period = n;
+			break;
+		case OPT_PERIODS:
+			if (!parse_subopt("realtime", keys[opt], val,
+						2, 1024, &n))
+				return false;
+			*nr_periods = n;
+			break;
+		default:
+			say(ERR, "realtime: unknown option: %s", val);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+__attribute__((cold))
+static bool parse_rate(const char *str, unsigned int *rate)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(str, &end, 0);
+	if (errno || end == str || *end != '\0' || !val || val > 768000) {
+		say(ERR, "bad sample rate: %s", str);
+		return false;
+	}
+
+	*rate = val;
+	return true;
+}
+
+__attribute__((cold))
+static bool parse_secs(const char *str, double *secs)
+{
+	char *end;
+
+	errno = 0;
+	*secs = strtod(str, &end);
+	if (errno || end == str || *end != '\0' || !(*secs >= 0)
+			|| *secs > 24 * 60 * 60) {
+		say(ERR, "bad number of seconds: %s", str);
+		return false;
+	}
 
 	return true;
 }
@@ -172,9 +927,172 @@ static bool handle_file(const char *fn)
 __attribute__((cold))
 int main(int argc, char **argv)
 {
+	static const struct option longopts[] = {
+		{"interp", required_argument, NULL, 'i'},
+		{"output", required_argument, NULL, 'o'},
+		{"npy", required_argument, NULL, 'n'},
+		{"rate", required_argument, NULL, 'r'},
+		{"quality", required_argument, NULL, 'q'},
+		{"stems", required_argument, NULL, 's'},
+		{"mute", required_argument, NULL, 'm'},
+		{"tier", required_argument, NULL, 't'},
+		{"length", required_argument, NULL, 'l'},
+		{"fade", required_argument, NULL, 'f'},
+		{"pipeline", no_argument, NULL, 'p'},
+		{"realtime", optional_argument, NULL, 'T'},
+		{"audition", required_argument, NULL, 'a'},
+		{"record", required_argument, NULL, 'L'},
+		{"replay", no_argument, NULL, 'R'},
+		{"dump-ram", required_argument, NULL, 'D'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0},
+	};
 	int ret = EXIT_SUCCESS;
+	resample_quality_t quality = RESAMPLE_MEDIUM;
+	struct npy_format npy = {};
+	sink_type_t sink[SINK_NR];
+	unsigned int nr_sinks = 0;
+	int fd = -1;
+	unsigned int rate = DSP_HZ;
+	bool record = false;
+	unsigned int period = 256;
+	unsigned int nr_periods = 4;
+	dsp_interp_t interp;
+	dsp_stems_t stems = DSP_STEMS_OFF;
+	dsp_tier_t tier;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "i:o:n:r:q:s:m:t:l:f:pT::a:L:RD:h", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'i':
+			if (!parse_interp(optarg, &interp))
+				return EXIT_FAILURE;
+			dsp_set_interp(interp);
+			break;
+		case 'o':
+			if (!parse_sinks(optarg, sink, &nr_sinks))
+				return EXIT_FAILURE;
+			break;
+		case 'n':
+			if (!parse_npy(optarg, &npy))
+				return EXIT_FAILURE;
+			sink_set_npy(&npy);
+			add_sink(sink, &nr_sinks, SINK_NPY);
+			break;
+		case 'r':
+			if (!parse_rate(optarg, &rate))
+				return EXIT_FAILURE;
+			break;
+		case 'q':
+			if (!parse_quality(optarg, &quality))
+				return EXIT_FAILURE;
+			break;
+		case 's':
+			if (!parse_stems(optarg, &stems))
+				return EXIT_FAILURE;
+			dsp_set_stems(stems);
+			break;
+		case 'm':
+			if (!parse_mute(optarg, &mute))
+				return EXIT_FAILURE;
+			break;
+		case 't':
+			if (!parse_tier(optarg, &tier))
+				return EXIT_FAILURE;
+			dsp_set_tier(tier);
+			break;
+		case 'l':
+			if (!parse_secs(optarg, &length_secs))
+				return EXIT_FAILURE;
+			if (length_secs * DSP_HZ < 1) {
+				say(ERR, "length must be at least a frame, "
+					"1/%u secs", DSP_HZ);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'f':
+			if (!parse_secs(optarg, &fade_secs))
+				return EXIT_FAILURE;
+			break;
+		case 'p':
+			dsp_set_pipelined(true);
+			break;
+		case 'T':
+			if (optarg != NULL && !parse_realtime(optarg, &period,
+							&nr_periods))
+				return EXIT_FAILURE;
+			sink_set_realtime(period, nr_periods);
+			break;
+		case 'a':
+			if (nr_voices == ARRAY_SIZE(voices)) {
+				say(ERR, "audition: only %zu voices",
+					ARRAY_SIZE(voices));
+				return EXIT_FAILURE;
+			}
+			if (!parse_note(optarg, &voices[nr_voices++]))
+				return EXIT_FAILURE;
+			break;
+		case 'L':
+			record = true;
+			dsp_log_record(optarg);
+			break;
+		case 'R':
+			replay = true;
+			break;
+		case 'D':
+			dump_fn = optarg;
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* there's only the one LOG for each to truncate */
+	if (record && argc - optind > 1) {
+		say(ERR, "can only record one render at once");
+		return EXIT_FAILURE;
+	}
+
+	dsp_set_output_rate(rate, quality);
+
+	if (!nr_sinks)
+		sink[nr_sinks++] = SINK_WAV;
+
+	for (unsigned int i = 0; i < nr_sinks; i++) {
+		/* FLAC stops at 8 channels, multi stems need 18 */
+		if (sink[i] == SINK_FLAC && stems == DSP_STEMS_MULTI) {
+			say(ERR, "flac can't hold every stem in one file, "
+				"split them instead");
+			return EXIT_FAILURE;
+		}
+
+		if (sink[i] != SINK_RAW)
+			continue;
+
+		fd = take_stdout();
+		if (fd < 0)
+			return EXIT_FAILURE;
+	}
+
+	dsp_set_sinks(sink, nr_sinks, fd);
+
+	if (argc - optind > 1
+			&& !check_output_names(argc - optind, argv + optind))
+		return EXIT_FAILURE;
+
+	for (int i = optind; i < argc; i++) {
+		char name[PATH_MAX];
+
+		/* or they'd all go to out.wav */
+		if (argc - optind > 1) {
+			output_name(argv[i], name);
+			dsp_set_output_name(name);
+		}
 
-	for (int i = 1; i < argc; i++) {
 		if (!handle_file(argv[i]))
 			ret = EXIT_FAILURE;
 	}
@@ -0,0 +1,364 @@
+#include <spu-kit/npy.h>
+#include <spu-kit/bufwr.h>
+
+#include "fd.h"
+#include "system.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define NPY_MAGIC	"\x93NUMPY"
+#define NPY_MAJOR	1
+#define NPY_MINOR	0
+
+/* The whole header, preamble and all. Room for any shape, so that it can be
+ * rewritten in place on close, and a multiple of 64 as numpy likes.
+ */
+#define HDR_LEN		128
+#define PREAMBLE_LEN	10
+
+#define OUT_BUF_SIZE	(256 * 1024)
+
+/* samples converted at a time */
+#define CHUNK		4096
+
+typedef int16_t v16hi __attribute__((vector_size(16 * sizeof(int16_t))));
+typedef float v16sf __attribute__((vector_size(16 * sizeof(float))));
+
+struct npy_s {
+	int fd;
+	bufwr_t *out;
+	npy_dtype_t dtype;
+	bool planar;
+	unsigned int channels;
+
+	/* frames per window, or 0 */
+	size_t window;
+
+	/* Interleaved frames waiting to go out as a window, or the whole
+	 * render when planar without windows.
+	 */
+	int16_t *held;
+	size_t nr_held;
+	size_t max_held;
+
+	/* frames written, and windows if there are any */
+	uint64_t nr_frames;
+	uint64_t nr_windows;
+
+	union {
+		float f32[CHUNK];
+		int16_t i16[CHUNK];
+	} conv;
+};
+
+__attribute__((const))
+static size_t sample_size(const npy_dtype_t dtype)
+{
+	switch (dtype) {
+	case NPY_FLOAT32:
+		return sizeof(float);
+	case NPY_INT16:
+		return sizeof(int16_t);
+	default:
+		unreachable();
+	}
+}
+
+/* 16 at a time, then whatever's left */
+static void to_f32(size_t nr;
+			float *out,
+			const int16_t in[static nr],
+			size_t nr)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= nr; i += 16) {
+		v16hi v;
+		v16sf f;
+
+		memcpy(&v, in + i, sizeof(v));
+		f = __builtin_convertvector(v, v16sf) * (1.0f / 32768.0f);
+		memcpy(out + i, &f, sizeof(f));
+	}
+
+	for (; i < nr; i++)
+		out[i] = in[i] * (1.0f / 32768.0f);
+}
+
+/* nr samples which are already in the order they go in the file */
+__attribute__((nonnull(1),warn_unused_result))
+static bool put_samples(npy_t *npy, const int16_t *in, size_t nr)
+{
+	if (npy->dtype == NPY_INT16)
+		return bufwr_write(npy->out, in, nr * sizeof(in[0]));
+
+	while (nr) {
+		const size_t n = (nr < CHUNK) ? nr : CHUNK;
+
+		to_f32(npy->conv.f32, in, n);
+		if (!bufwr_write(npy->out, npy->conv.f32,
+					n * sizeof(npy->conv.f32[0])))
+			return false;
+
+		in += n;
+		nr -= n;
+	}
+
+	return true;
+}
+
+/* The held frames, one channel after another */
+__attribute__((nonnull(1),warn_unused_result))
+static bool put_planar(npy_t *npy)
+{
+	const unsigned int ch = npy->channels;
+
+	for (unsigned int c = 0; c < ch; c++) {
+		for (size_t i = 0; i < npy->nr_held; i += CHUNK) {
+			const size_t n = (npy->nr_held - i < CHUNK)
+					? npy->nr_held - i : CHUNK;
+			int16_t plane[CHUNK];
+
+			for (size_t j = 0; j < n; j++)
+				plane[j] = npy->held[(i + j) * ch + c];
+
+			if (!put_samples(npy, plane, n))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+__attribute__((nonnull(1),warn_unused_result))
+static bool put_window(npy_t *npy)
+{
+	const bool ret = (npy->planar)
+		? put_planar(npy)
+		: put_samples(npy, npy->held, npy->nr_held * npy->channels);
+
+	npy->nr_frames += npy->nr_held;
+	npy->nr_windows++;
+	npy->nr_held = 0;
+
+	return ret;
+}
+
+static void make_hdr(const npy_t *npy, uint8_t hdr[static HDR_LEN])
+{
+	char shape[64];
+	int len;
+
+	if (npy->window && npy->planar) {
+		snprintf(shape, sizeof(shape), "%" PRIu64 ", %u, %zu",
+			npy->nr_windows, npy->channels, npy->window);
+	} else if (npy->window) {
+		snprintf(shape, sizeof(shape), "%" PRIu64 ", %zu, %u",
+			npy->nr_windows, npy->window, npy->channels);
+	} else if (npy->planar) {
+		snprintf(shape, sizeof(shape), "%u, %" PRIu64,
+			npy->channels, npy->nr_frames);
+	} else {
+		snprintf(shape, sizeof(shape), "%" PRIu64 ", %u",
+			npy->nr_frames, npy->channels);
+	}
+
+	memset(hdr, ' ', HDR_LEN);
+	memcpy(hdr, NPY_MAGIC, strlen(NPY_MAGIC));
+	hdr[6] = NPY_MAJOR;
+	hdr[7] = NPY_MINOR;
+	hdr[8] = (HDR_LEN - PREAMBLE_LEN) & 0xff;
+	hdr[9] = (HDR_LEN - PREAMBLE_LEN) >> 8;
+
+	len = snprintf((char *)hdr + PREAMBLE_LEN, HDR_LEN - PREAMBLE_LEN,
+		"{'descr': '<%c%zu', 'fortran_order': False, 'shape': (%s), }",
+		(npy->dtype == NPY_FLOAT32) ? 'f' : 'i',
+		sample_size(npy->dtype), shape);
+	xassert(len > 0 && len < HDR_LEN - PREAMBLE_LEN);
+
+	/* snprintf's NUL goes back to being padding */
+	hdr[PREAMBLE_LEN + len] = ' ';
+	hdr[HDR_LEN - 1] = '\n';
+}
+
+npy_t *npy_create(const char *fn,
+			const unsigned int rate,
+			const unsigned int channels,
+			const struct npy_format *fmt)
+{
+	uint8_t hdr[HDR_LEN];
+	npy_t *npy;
+
+	npy = calloc(1, sizeof(*npy));
+	if (npy == NULL) {
+		say(ERR, "npy: out of memory");
+		goto out;
+	}
+
+	*npy = (struct npy_s){
+		.dtype = fmt->dtype,
+		.planar = fmt->planar,
+		.channels = channels,
+		.window = (uint64_t)fmt->window_ms * rate / 1000,
+	};
+
+	if (fmt->window_ms && !npy->window) {
+		say(ERR, "npy: %lu ms windows are less than a frame",
+			fmt->window_ms);
+		goto out_free;
+	}
+
+	/* planar without windows holds the whole render, grown as it goes */
+	if (npy->window) {
+		npy->max_held = npy->window;
+		npy->held = malloc(npy->max_held * channels
+					* sizeof(npy->held[0]));
+		if (npy->held == NULL) {
+			say(ERR, "npy: out of memory");
+			goto out_free;
+		}
+	}
+
+	npy->fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (npy->fd < 0) {
+		say(ERR, "%s: open: %s", fn, strerror(errno));
+		goto out_free_held;
+	}
+
+	npy->out = bufwr_new(npy->fd, OUT_BUF_SIZE);
+	if (npy->out == NULL) {
+		say(ERR, "npy: out of memory");
+		goto out_close;
+	}
+
+	/* the shape is patched in on close */
+	make_hdr(npy, hdr);
+	if (!bufwr_write(npy->out, hdr, sizeof(hdr))) {
+		say(ERR, "%s: write: %s", fn, strerror(errno));
+		goto out_abort;
+	}
+
+	return npy;
+
+out_abort:
+	bufwr_abort(npy->out);
+	goto out_free_held;
+out_close:
+	close(npy->fd);
+out_free_held:
+	free(npy->held);
+out_free:
+	free(npy);
+out:
+	return NULL;
+}
+
+/* Everything gets held until there's a window's worth, or until close */
+__attribute__((nonnull(1),warn_unused_result))
+static bool hold(npy_t *npy, const int16_t *sample, size_t frames)
+{
+	const unsigned int ch = npy->channels;
+
+	while (frames) {
+		size_t take;
+
+		if (npy->nr_held == npy->max_held) {
+			const size_t max = (npy->max_held)
+					? npy->max_held * 2 : CHUNK;
+			int16_t *held;
+
+			xassert(!npy->window);
+
+			held = realloc(npy->held, max * ch * sizeof(held[0]));
+			if (held == NULL) {
+				errno = ENOMEM;
+				return false;
+			}
+
+			npy->held = held;
+			npy->max_held = max;
+		}
+
+		take = npy->max_held - npy->nr_held;
+		if (take > frames)
+			take = frames;
+
+		memcpy(&npy->held[npy->nr_held * ch], sample,
+			take * ch * sizeof(sample[0]));
+		npy->nr_held += take;
+		sample += take * ch;
+		frames -= take;
+
+		if (npy->window && npy->nr_held == npy->window
+				&& !put_window(npy))
+			return false;
+	}
+
+	return true;
+}
+
+__attribute__((nonnull(1),warn_unused_result))
+bool npy_write_samples16(size_t num;
+		npy_t *npy,
+		const int16_t sample[static num],
+		size_t num)
+{
+	bool ret;
+
+	if (npy->window || npy->planar) {
+		ret = hold(npy, sample, num / npy->channels);
+	} else {
+		ret = put_samples(npy, sample, num);
+		npy->nr_frames += num / npy->channels;
+	}
+
+	if (unlikely(!ret)) {
+		say(ERR, "npy: write: %s", strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+__attribute__((nonnull(1),warn_unused_result))
+bool _npy_close(npy_t *npy)
+{
+	uint8_t hdr[HDR_LEN];
+	bool ret = true;
+
+	if (npy->window) {
+		if (npy->nr_held)
+			say(INFO, "npy: dropped the last %zu frames, short of "
+				"a window", npy->nr_held);
+	} else if (npy->planar) {
+		npy->nr_frames = npy->nr_held;
+		if (!put_planar(npy)) {
+			say(ERR, "npy: write: %s", strerror(errno));
+			ret = false;
+		}
+	}
+
+	if (ret && !bufwr_flush(npy->out)) {
+		say(ERR, "npy: write: %s", strerror(errno));
+		ret = false;
+	}
+
+	make_hdr(npy, hdr);
+	if (ret && !fd_pwrite(npy->fd, 0, hdr, sizeof(hdr))) {
+		say(ERR, "npy: write: %s", strerror(errno));
+		ret = false;
+	}
+
+	if (!bufwr_close(npy->out, false))
+		ret = false;
+
+	free(npy->held);
+	free(npy);
+
+	return ret;
+}
@@ -0,0 +1,407 @@
+#include <spu-kit/pacer.h>
+
+#include "system.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#define NSEC		1000000000ULL
+
+/* Render times are kept HDR histogram style: exact below HIST_SUB ns, then
+ * HIST_SUB buckets for each power of two above that, so to within 1/HIST_SUB
+ * of the time, however long.
+ */
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1U << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* how often to look again while waiting on the other side, as a fraction of a
+ * period, when there's no deadline to wait for
+ */
+#define POLL_DIV	8
+
+struct pacer_s {
+	/* samples ever queued, written by the renderer */
+	_Atomic uint64_t head __attribute__((aligned(64)));
+
+	/* samples ever handed to out, written by the consumer, along with when
+	 * it next takes a period, which is when a full queue next has room
+	 */
+	_Atomic uint64_t tail __attribute__((aligned(64)));
+	_Atomic uint64_t deadline;
+
+	atomic_bool stop;
+	atomic_bool err;
+
+	/* renderer only: our copies of head and tail, when we last returned,
+	 * and how long the period being filled has taken to render so far
+	 */
+	uint64_t r_head __attribute__((aligned(64)));
+	uint64_t r_tail;
+	uint64_t last;
+	double period_ns;
+	uint64_t hist[HIST_BUCKETS];
+	uint64_t nr_timed;
+
+	/* consumer only */
+	uint64_t nr_out;
+	uint64_t nr_underruns;
+	uint64_t max_late;
+	/* the fewest frames queued at a deadline, counting the period due */
+	uint64_t min_queued;
+
+	sink_t *out;
+	char *name;
+	unsigned int rate;
+	unsigned int channels;
+	unsigned int period;
+	unsigned int nr_periods;
+	/* in samples */
+	size_t period_len;
+	size_t size;
+	pthread_t thread;
+	int16_t ring[];
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+static void sleep_until(const uint64_t ns)
+{
+	const struct timespec ts = {
+		.tv_sec = ns / NSEC,
+		.tv_nsec = ns % NSEC,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+			== EINTR)
+		;
+}
+
+__attribute__((pure))
+static uint64_t poll_ns(const pacer_t *p)
+{
+	return p->period * NSEC / p->rate / POLL_DIV;
+}
+
+__attribute__((const))
+static unsigned int hist_idx(const uint64_t v)
+{
+	unsigned int shift;
+
+	if (v < HIST_SUB)
+		return v;
+
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) | ((v >> shift) & (HIST_SUB - 1));
+}
+
+/* the least value in bucket i */
+__attribute__((const))
+static uint64_t hist_lo(const unsigned int i)
+{
+	if (i < HIST_SUB)
+		return i;
+
+	return (uint64_t)(HIST_SUB | (i & (HIST_SUB - 1)))
+		<< ((i >> HIST_SUB_BITS) - 1);
+}
+
+/* the greatest value in bucket i */
+__attribute__((const))
+static uint64_t hist_hi(const unsigned int i)
+{
+	return (i + 1 < HIST_BUCKETS) ? hist_lo(i + 1) - 1 : UINT64_MAX;
+}
+
+/* The greatest value at or below which fraction q of them are */
+__attribute__((pure))
+static uint64_t hist_quantile(const pacer_t *p, const double q)
+{
+	const uint64_t want = (uint64_t)(q * p->nr_timed + 0.5);
+	uint64_t seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		seen += p->hist[i];
+		if (seen >= want && seen)
+			break;
+	}
+
+	return hist_hi(i);
+}
+
+static void *consumer(void *arg)
+{
+	pacer_t * const p = arg;
+	uint64_t tail = 0;
+	uint64_t start;
+
+	/* until the queue's full, or that's all there's going to be */
+	while (atomic_load_explicit(&p->head, memory_order_acquire) < p->size
+			&& !atomic_load_explicit(&p->stop, memory_order_acquire))
+		sleep_until(now_ns() + poll_ns(p));
+
+	start = now_ns();
+
+	for (uint64_t k = 0;; k++) {
+		const uint64_t deadline = start + k * p->period * NSEC / p->rate;
+		uint64_t head, n;
+		bool late = false;
+		bool draining;
+
+		atomic_store_explicit(&p->deadline, deadline,
+					memory_order_relaxed);
+		sleep_until(deadline);
+
+		/* the queue only drains once there's nothing more to come */
+		draining = atomic_load_explicit(&p->stop, memory_order_acquire);
+		head = atomic_load_explicit(&p->head, memory_order_acquire);
+
+		/* a whole period, or whatever's left at the end */
+		while (head - tail < p->period_len) {
+			/* stop comes after the last of head */
+			if (atomic_load_explicit(&p->stop,
+						memory_order_acquire)) {
+				head = atomic_load_explicit(&p->head,
+							memory_order_acquire);
+				break;
+			}
+
+			if (!late) {
+				late = true;
+				p->nr_underruns++;
+			}
+
+			sleep_until(now_ns() + poll_ns(p));
+			head = atomic_load_explicit(&p->head,
+						memory_order_acquire);
+		}
+
+		n = head - tail;
+		if (!n)
+			break;
+
+		if (n >= p->period_len) {
+			const uint64_t queued = n / p->channels;
+
+			if (!late && !draining && queued < p->min_queued)
+				p->min_queued = queued;
+			n = p->period_len;
+		}
+
+		if (late && now_ns() - deadline > p->max_late)
+			p->max_late = now_ns() - deadline;
+
+		if (!sink_write(p->out, p->ring + tail % p->size, n)
+				|| !sink_flush(p->out)) {
+			atomic_store_explicit(&p->err, true,
+						memory_order_release);
+			break;
+		}
+
+		tail += n;
+		atomic_store_explicit(&p->tail, tail, memory_order_release);
+		p->nr_out++;
+	}
+
+	return NULL;
+}
+
+pacer_t *pacer_new(sink_t *out,
+			const char *name,
+			const unsigned int rate,
+			const unsigned int channels,
+			const unsigned int period,
+			const unsigned int nr_periods)
+{
+	const size_t size = (size_t)period * channels * nr_periods;
+	pacer_t *p;
+	int err;
+
+	xassert(period && nr_periods);
+
+	p = aligned_alloc(64, (sizeof(*p) + size * sizeof(p->ring[0]) + 63)
+				& ~(size_t)63);
+	if (p == NULL) {
+		say(ERR, "pacer: out of memory");
+		goto out;
+	}
+
+	memset(p, 0, sizeof(*p));
+
+	p->name = strdup(name);
+	if (p->name == NULL) {
+		say(ERR, "pacer: out of memory");
+		goto out_free;
+	}
+
+	p->out = out;
+	p->rate = rate;
+	p->channels = channels;
+	p->period = period;
+	p->nr_periods = nr_periods;
+	p->period_len = (size_t)period * channels;
+	p->size = size;
+	p->min_queued = UINT64_MAX;
+	p->last = now_ns();
+
+	err = pthread_create(&p->thread, NULL, consumer, p);
+	if (err) {
+		say(ERR, "pacer: pthread_create: %s", strerror(err));
+		goto out_free_name;
+	}
+
+	return p;
+
+out_free_name:
+	free(p->name);
+out_free:
+	free(p);
+out:
+	return NULL;
+}
+
+/* Rendering is timed from one write returning to the next being made, which
+ * leaves out waiting for room, and shared out over the frames it made, as the
+ * blocks written needn't line up with periods.
+ */
+__attribute__((nonnull(1),warn_unused_result))
+bool pacer_write_samples16(size_t num;
+		pacer_t *p,
+		const int16_t sample[static num],
+		size_t num)
+{
+	const double ns_per_sample = (num)
+		? (double)(now_ns() - p->last) / num : 0.0;
+	uint64_t head = p->r_head;
+	bool ret = true;
+
+	while (num) {
+		/* periods are never split by the end of the ring */
+		size_t n = p->period_len - head % p->period_len;
+
+		if (n > num)
+			n = num;
+
+		while (head + n - p->r_tail > p->size) {
+			uint64_t deadline, now;
+
+			p->r_tail = atomic_load_explicit(&p->tail,
+							memory_order_acquire);
+			if (head + n - p->r_tail <= p->size)
+				break;
+
+			if (unlikely(atomic_load_explicit(&p->err,
+						memory_order_acquire))) {
+				ret = false;
+				goto out;
+			}
+
+			deadline = atomic_load_explicit(&p->deadline,
+							memory_order_relaxed);
+			now = now_ns();
+			sleep_until((deadline > now)
+					? deadline : now + poll_ns(p));
+		}
+
+		memcpy(p->ring + head % p->size, sample, n * sizeof(sample[0]));
+		head += n;
+		atomic_store_explicit(&p->head, head, memory_order_release);
+
+		p->period_ns += ns_per_sample * n;
+		if (!(head % p->period_len)) {
+			p->hist[hist_idx((uint64_t)p->period_ns)]++;
+			p->nr_timed++;
+			p->period_ns = 0.0;
+		}
+
+		sample += n;
+		num -= n;
+	}
+
+out:
+	p->r_head = head;
+	p->last = now_ns();
+	return ret && !atomic_load_explicit(&p->err, memory_order_acquire);
+}
+
+__attribute__((cold))
+static void report(const pacer_t *p)
+{
+	static const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+	const double period_us = 1e6 * p->period / p->rate;
+	uint64_t seen = 0;
+
+	say(INFO, "%s: realtime: %" PRIu64 " periods of %u frames, %.1f us "
+		"each, %u queued", p->name, p->nr_out, p->period, period_us,
+		p->nr_periods);
+
+	if (p->nr_underruns) {
+		say(INFO, "%s: %" PRIu64 " underruns, up to %.1f us late",
+			p->name, p->nr_underruns, p->max_late / 1e3);
+	} else if (p->min_queued != UINT64_MAX) {
+		say(INFO, "%s: no underruns, %.1f us to spare at the least",
+			p->name, 1e6 * (p->min_queued - p->period) / p->rate);
+	}
+
+	if (!p->nr_timed)
+		return;
+
+	say(INFO, "%s: render time per period:", p->name);
+	for (size_t i = 0; i < ARRAY_SIZE(quantiles); i++) {
+		const uint64_t ns = hist_quantile(p, quantiles[i]);
+
+		say(INFO, "%s:  %7.3f%%  %10.1f us  %5.1f%% of a period",
+			p->name, 100.0 * quantiles[i], ns / 1e3,
+			100.0 * ns / 1e3 / period_us);
+	}
+
+	say(INFO, "%s:       up to (us)      count   cumulative", p->name);
+	for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+		if (!p->hist[i])
+			continue;
+
+		seen += p->hist[i];
+		say(INFO, "%s:  %15.1f %10" PRIu64 "  %10.3f%%", p->name,
+			hist_hi(i) / 1e3, p->hist[i],
+			100.0 * seen / p->nr_timed);
+	}
+}
+
+__attribute__((nonnull(1),warn_unused_result))
+bool _pacer_close(pacer_t *p)
+{
+	bool ret = true;
+	int err;
+
+	atomic_store_explicit(&p->stop, true, memory_order_release);
+
+	err = pthread_join(p->thread, NULL);
+	if (unlikely(err)) {
+		say(ERR, "pacer: pthread_join: %s", strerror(err));
+		ret = false;
+	}
+
+	report(p);
+
+	if (atomic_load_explicit(&p->err, memory_order_relaxed))
+		ret = false;
+	if (!sink_close(p->out))
+		ret = false;
+
+	free(p->name);
+	free(p);
+
+	return ret;
+}
@@ -0,0 +1,304 @@
+#include <spu-kit/resample.h>
+
+#include "system.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MAX_TAPS	32
+
+typedef int16_t v8hi __attribute__((vector_size(8 * sizeof(int16_t))));
+typedef int32_t v8si __attribute__((vector_size(8 * sizeof(int32_t))));
+typedef int32_t v4si __attribute__((vector_size(4 * sizeof(int32_t))));
+typedef int32_t v2si __attribute__((vector_size(2 * sizeof(int32_t))));
+
+struct resample_s {
+	/* output rate / input rate, reduced */
+	unsigned int up;
+	unsigned int down;
+
+	unsigned int taps;
+
+	/* up * position of the next output frame, relative to the most
+	 * recent input frame
+	 */
+	unsigned int phase;
+
+	/* number of consecutive zero frames at the end of the history */
+	unsigned int zeros;
+
+	/* The filter's delay in output frames, rounded, and how many of those
+	 * are still to be dropped from the start.  resample_flush() makes
+	 * them up again at the end, so the output lines up with the input and
+	 * is as long as it would have been without dropping anything.
+	 */
+	unsigned int delay;
+	unsigned int skip;
+
+	/* Like the echo FIR, the history is stored twice over so the last
+	 * taps frames are always contiguous, oldest first, starting at pos.
+	 */
+	unsigned int pos;
+	int16_t hist_l[MAX_TAPS * 2] __attribute__((aligned(32)));
+	int16_t hist_r[MAX_TAPS * 2] __attribute__((aligned(32)));
+
+	/* up phases of taps coefficients each, Q15, oldest tap first */
+	int16_t coeff[] __attribute__((aligned(32)));
+};
+
+static const struct {
+	unsigned int taps;
+	double beta;
+	double rolloff;
+} tiers[] = {
+	[RESAMPLE_FAST] = { 8, 5.0, 0.80 },
+	[RESAMPLE_MEDIUM] = { 16, 7.0, 0.88 },
+	[RESAMPLE_BEST] = { 32, 9.0, 0.93 },
+};
+
+__attribute__((const))
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	while (b) {
+		const unsigned int t = a % b;
+
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/* zeroth order modified bessel function of the first kind */
+__attribute__((const))
+static double bessel_i0(const double x)
+{
+	double sum = 1.0;
+	double term = 1.0;
+
+	for (unsigned int k = 1; term > sum * 1e-12; k++) {
+		const double f = x / (2.0 * k);
+
+		term *= f * f;
+		sum += term;
+	}
+
+	return sum;
+}
+
+/* Kaiser windowed sinc prototype, sampled at up times the input rate, split in
+ * to phases and normalised so that each phase has unity gain at DC.
+ */
+__attribute__((cold))
+static void design(resample_t *r, const double beta, const double rolloff)
+{
+	const unsigned int len = r->up * r->taps;
+	const double centre = (len - 1) / 2.0;
+	const double cutoff = rolloff * 0.5
+				* ((r->up < r->down) ? (double)r->up / r->down : 1.0);
+	const double norm = bessel_i0(beta);
+
+	for (unsigned int p = 0; p < r->up; p++) {
+		double h[MAX_TAPS];
+		double sum = 0.0;
+
+		for (unsigned int k = 0; k < r->taps; k++) {
+			const double x = (k * r->up + p - centre) / r->up;
+			const double w = (x / centre) * r->up;
+			const double s = (x == 0.0)
+					? 1.0 : sin(M_PI * 2.0 * cutoff * x)
+						/ (M_PI * 2.0 * cutoff * x);
+
+			h[k] = s * bessel_i0(beta * sqrt(fmax(0.0, 1.0 - w * w)))
+				/ norm;
+			sum += h[k];
+		}
+
+		/* h[k] is for the input frame k before the output, reverse it
+		 * to line up with the history
+		 */
+		for (unsigned int k = 0; k < r->taps; k++) {
+			r->coeff[p * r->taps + (r->taps - 1 - k)] =
+				lrint(h[k] / sum * 32768.0);
+		}
+	}
+}
+
+resample_t *resample_new(const unsigned int in_rate,
+			const unsigned int out_rate,
+			const resample_quality_t quality)
+{
+	const unsigned int g = gcd(in_rate, out_rate);
+	unsigned int up, taps;
+	resample_t *r;
+
+	if (!in_rate || !out_rate) {
+		say(ERR, "resample: bad rate %u -> %u", in_rate, out_rate);
+		return NULL;
+	}
+
+	if ((unsigned int)quality >= ARRAY_SIZE(tiers)) {
+		say(ERR, "resample: bad quality %u", quality);
+		return NULL;
+	}
+
+	up = out_rate / g;
+	taps = tiers[quality].taps;
+
+	r = aligned_alloc(32, sizeof(*r) + ((up * taps * sizeof(r->coeff[0]) + 31) & ~31UL));
+	if (unlikely(r == NULL)) {
+		say(ERR, "resample: %u phases: out of memory", up);
+		return NULL;
+	}
+
+	memset(r, 0, sizeof(*r));
+	r->up = up;
+	r->down = in_rate / g;
+	r->taps = taps;
+	r->zeros = taps;
+	/* the prototype is centred (up * taps - 1) / 2 in, at up times the
+	 * input rate, which is down times the output rate
+	 */
+	r->delay = (up * taps - 1 + r->down) / (2 * r->down);
+	r->skip = r->delay;
+
+	design(r, tiers[quality].beta, tiers[quality].rolloff);
+
+	say(INFO, "resample: %u -> %u Hz, %u/%u, %u taps",
+		in_rate, out_rate, r->up, r->down, r->taps);
+
+	return r;
+}
+
+size_t resample_max_out(const resample_t *r, const size_t nr)
+{
+	return (nr * r->up + r->down - 1) / r->down + 1;
+}
+
+static inline int16_t clamp16(const int32_t acc)
+{
+	const int32_t v = (acc + (1 << 14)) >> 15;
+
+	if (v > INT16_MAX)
+		return INT16_MAX;
+	if (v < INT16_MIN)
+		return INT16_MIN;
+	return v;
+}
+
+/* one output frame from the current history, 8 taps at a time */
+static inline void convolve(const resample_t *r,
+				const unsigned int phase,
+				int16_t out[static 2])
+{
+	const int16_t *k = &r->coeff[phase * r->taps];
+	const int16_t *hl = &r->hist_l[r->pos];
+	const int16_t *hr = &r->hist_r[r->pos];
+	v8si acc_l = {0}, acc_r = {0};
+	v4si l4, r4;
+	v2si l2, r2;
+
+	for (unsigned int i = 0; i < r->taps; i += 8) {
+		v8hi c, l, rr;
+		v8si c32;
+
+		memcpy(&c, k + i, sizeof(c));
+		memcpy(&l, hl + i, sizeof(l));
+		memcpy(&rr, hr + i, sizeof(rr));
+
+		c32 = __builtin_convertvector(c, v8si);
+		acc_l += __builtin_convertvector(l, v8si) * c32;
+		acc_r += __builtin_convertvector(rr, v8si) * c32;
+	}
+
+	l4 = __builtin_shufflevector(acc_l, acc_l, 0, 1, 2, 3)
+		+ __builtin_shufflevector(acc_l, acc_l, 4, 5, 6, 7);
+	r4 = __builtin_shufflevector(acc_r, acc_r, 0, 1, 2, 3)
+		+ __builtin_shufflevector(acc_r, acc_r, 4, 5, 6, 7);
+	l2 = __builtin_shufflevector(l4, l4, 0, 1)
+		+ __builtin_shufflevector(l4, l4, 2, 3);
+	r2 = __builtin_shufflevector(r4, r4, 0, 1)
+		+ __builtin_shufflevector(r4, r4, 2, 3);
+
+	out[0] = clamp16(l2[0] + l2[1]);
+	out[1] = clamp16(r2[0] + r2[1]);
+}
+
+static inline void push(resample_t *r, const int16_t l, const int16_t rr)
+{
+	r->hist_l[r->pos] = r->hist_l[r->pos + r->taps] = l;
+	r->hist_r[r->pos] = r->hist_r[r->pos + r->taps] = rr;
+	if (++r->pos == r->taps)
+		r->pos = 0;
+
+	if (l || rr) {
+		r->zeros = 0;
+	} else if (r->zeros < r->taps) {
+		r->zeros++;
+	}
+}
+
+/* the next output frame, if it's not one of the delay's */
+static inline int16_t *emit(resample_t *r, int16_t *ptr)
+{
+	if (unlikely(r->skip)) {
+		r->skip--;
+		return ptr;
+	}
+
+	/* Silence in, silence out, no need to convolve */
+	if (r->zeros >= r->taps) {
+		ptr[0] = ptr[1] = 0;
+	} else {
+		convolve(r, r->phase, ptr);
+	}
+
+	return ptr + 2;
+}
+
+size_t resample_run(size_t nr;
+			resample_t *r,
+			const int16_t in[static nr * 2],
+			size_t nr,
+			int16_t *out)
+{
+	int16_t *ptr = out;
+
+	for (size_t i = 0; i < nr; i++) {
+		push(r, in[i * 2 + 0], in[i * 2 + 1]);
+
+		while (r->phase < r->up) {
+			ptr = emit(r, ptr);
+			r->phase += r->down;
+		}
+		r->phase -= r->up;
+	}
+
+	return (ptr - out) / 2;
+}
+
+size_t resample_flush(resample_t *r, int16_t *out)
+{
+	unsigned int left = r->delay;
+	int16_t *ptr = out;
+
+	while (left) {
+		push(r, 0, 0);
+
+		while (left && r->phase < r->up) {
+			ptr = emit(r, ptr);
+			r->phase += r->down;
+			left--;
+		}
+		if (r->phase >= r->up)
+			r->phase -= r->up;
+	}
+
+	return (ptr - out) / 2;
+}
+
+void resample_free(resample_t *r)
+{
+	free(r);
+}
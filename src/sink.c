@@ -0,0 +1,555 @@
+#include <spu-kit/sink.h>
+#include <spu-kit/wav.h>
+#include <spu-kit/flac.h>
+#include <spu-kit/npy.h>
+#include <spu-kit/stats.h>
+#include <spu-kit/pacer.h>
+#include <spu-kit/bufwr.h>
+
+#include "system.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+/* big enough that a pipe gets a few large writes rather than lots of small */
+#define RAW_BUF_SIZE	(256 * 1024)
+
+/* buffers in flight at once, so a slow disk or a full pipe doesn't hold up
+ * rendering until they're all waiting on it
+ */
+#define SINK_BUFS	4
+
+/* how much each sink in a tee can fall behind, and how much of that it's
+ * given at once
+ */
+#define TEE_QUEUE_SECS	2
+#define TEE_CHUNK	4096
+
+struct tee_out {
+	sink_t *sink;
+	/* sink_flush() it once it's written up to flush_at */
+	bool flush;
+	uint64_t flush_at;
+	/* whole frames of samples */
+	int16_t *ring;
+	size_t size;
+	/* the most it's given at once */
+	size_t chunk;
+	/* samples ever queued, and ever written to sink */
+	uint64_t head;
+	uint64_t tail;
+	bool stop;
+	bool err;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t drained;
+	pthread_t thread;
+};
+
+struct tee {
+	unsigned int nr;
+	struct tee_out out[];
+};
+
+struct sink_s {
+	sink_type_t type;
+	/* instead of type when there's more than one, or when paced */
+	struct tee *tee;
+	pacer_t *pacer;
+	union {
+		wav_t *wav;
+		flac_t *flac;
+		npy_t *npy;
+		bufwr_t *raw;
+		stats_t *stats;
+	};
+};
+
+static struct npy_format npy_fmt = {
+	.dtype = NPY_FLOAT32,
+};
+
+/* frames per period and periods queued, or 0 when not paced */
+static unsigned int rt_period;
+static unsigned int rt_periods;
+
+void sink_set_npy(const struct npy_format *fmt)
+{
+	npy_fmt = *fmt;
+}
+
+void sink_set_realtime(const unsigned int period,
+			const unsigned int nr_periods)
+{
+	rt_period = period;
+	rt_periods = nr_periods;
+}
+
+/* NULL for those that don't write a file */
+__attribute__((const))
+static const char *sink_ext(const sink_type_t type)
+{
+	switch (type) {
+	case SINK_WAV:
+		return "wav";
+	case SINK_FLAC:
+		return "flac";
+	case SINK_NPY:
+		return "npy";
+	case SINK_RAW:
+	case SINK_STATS:
+	case SINK_NULL:
+		return NULL;
+	default:
+		unreachable();
+	}
+}
+
+sink_t *sink_new(const sink_type_t type,
+		const char *name,
+		const int fd,
+		const unsigned int rate,
+		const unsigned int channels)
+{
+	const char * const ext = sink_ext(type);
+	char fn[PATH_MAX];
+	sink_t *s;
+
+	if (ext != NULL)
+		snprintf(fn, sizeof(fn), "%s.%s", name, ext);
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		say(ERR, "sink: out of memory");
+		goto out;
+	}
+
+	s->type = type;
+
+	switch (type) {
+	case SINK_WAV:
+		s->wav = wav_create(fn, rate, channels);
+		if (s->wav == NULL)
+			goto out_free;
+		break;
+	case SINK_FLAC:
+		s->flac = flac_create(fn, rate, channels);
+		if (s->flac == NULL)
+			goto out_free;
+		break;
+	case SINK_NPY:
+		s->npy = npy_create(fn, rate, channels, &npy_fmt);
+		if (s->npy == NULL)
+			goto out_free;
+		break;
+	case SINK_RAW:
+		s->raw = bufwr_new(fd, RAW_BUF_SIZE);
+		if (s->raw == NULL) {
+			say(ERR, "sink: out of memory");
+			goto out_free;
+		}
+		if (!bufwr_async(s->raw, SINK_BUFS))
+			say(WARN, "sink: writing synchronously: %s",
+				strerror(errno));
+		break;
+	case SINK_STATS:
+		s->stats = stats_new(name, rate, channels);
+		if (s->stats == NULL)
+			goto out_free;
+		break;
+	case SINK_NULL:
+		break;
+	default:
+		unreachable();
+	}
+
+	return s;
+
+out_free:
+	free(s);
+	s = NULL;
+out:
+	return s;
+}
+
+/* Hands a sink in a tee what's queued for it, a chunk at a time */
+static void *teed(void *arg)
+{
+	struct tee_out * const o = arg;
+
+	pthread_mutex_lock(&o->lock);
+
+	while (!o->err) {
+		size_t off, n;
+		bool ok;
+
+		while (o->head == o->tail && !o->stop
+				&& !(o->flush && o->tail >= o->flush_at))
+			pthread_cond_wait(&o->filled, &o->lock);
+
+		if (o->flush && o->tail >= o->flush_at) {
+			o->flush = false;
+			pthread_mutex_unlock(&o->lock);
+
+			ok = sink_flush(o->sink);
+
+			pthread_mutex_lock(&o->lock);
+			o->err = !ok;
+			continue;
+		}
+
+		if (o->head == o->tail)
+			break;
+
+		/* up to the end of the ring, which is on a frame boundary */
+		off = o->tail % o->size;
+		n = o->head - o->tail;
+		if (n > o->size - off)
+			n = o->size - off;
+		if (n > o->chunk)
+			n = o->chunk;
+		pthread_mutex_unlock(&o->lock);
+
+		ok = sink_write(o->sink, o->ring + off, n);
+
+		pthread_mutex_lock(&o->lock);
+		o->tail += n;
+		o->err = !ok;
+		pthread_cond_signal(&o->drained);
+	}
+
+	pthread_mutex_unlock(&o->lock);
+	return NULL;
+}
+
+/* Queues it for each sink in turn, as much at a time as there's room for, so
+ * writes bigger than the queue are fine. A sink that's failed has already said
+ * why, and gets nothing more.
+ */
+__attribute__((nonnull(1),warn_unused_result))
+static bool tee_write(size_t num;
+			struct tee *t,
+			const int16_t sample[static num],
+			size_t num)
+{
+	bool ret = true;
+
+	for (unsigned int i = 0; i < t->nr; i++) {
+		struct tee_out * const o = &t->out[i];
+		const int16_t *p = sample;
+		size_t left = num;
+
+		while (left) {
+			size_t off, n, room;
+			bool err;
+
+			pthread_mutex_lock(&o->lock);
+			while (o->head - o->tail == o->size && !o->err)
+				pthread_cond_wait(&o->drained, &o->lock);
+			err = o->err;
+			room = o->size - (o->head - o->tail);
+			pthread_mutex_unlock(&o->lock);
+
+			if (unlikely(err)) {
+				ret = false;
+				break;
+			}
+
+			/* both are whole frames, so this is too */
+			if (room > left)
+				room = left;
+
+			/* the thread won't look past head until we move it */
+			off = o->head % o->size;
+			n = (room < o->size - off) ? room : o->size - off;
+			memcpy(o->ring + off, p, n * sizeof(p[0]));
+			memcpy(o->ring, p + n, (room - n) * sizeof(p[0]));
+
+			pthread_mutex_lock(&o->lock);
+			o->head += room;
+			pthread_cond_signal(&o->filled);
+			pthread_mutex_unlock(&o->lock);
+
+			p += room;
+			left -= room;
+		}
+	}
+
+	return ret;
+}
+
+/* Each sink's thread flushes once it's written everything queued so far */
+__attribute__((nonnull(1),warn_unused_result))
+static bool tee_flush(struct tee *t)
+{
+	bool ret = true;
+
+	for (unsigned int i = 0; i < t->nr; i++) {
+		struct tee_out * const o = &t->out[i];
+
+		pthread_mutex_lock(&o->lock);
+		o->flush = true;
+		o->flush_at = o->head;
+		if (o->err)
+			ret = false;
+		pthread_cond_signal(&o->filled);
+		pthread_mutex_unlock(&o->lock);
+	}
+
+	return ret;
+}
+
+/* Lets the first nr sinks finish what's queued, and closes them */
+__attribute__((cold,nonnull(1)))
+static bool tee_close(struct tee *t, const unsigned int nr)
+{
+	bool ret = true;
+
+	for (unsigned int i = 0; i < nr; i++) {
+		struct tee_out * const o = &t->out[i];
+		int err;
+
+		pthread_mutex_lock(&o->lock);
+		o->stop = true;
+		pthread_cond_signal(&o->filled);
+		pthread_mutex_unlock(&o->lock);
+
+		err = pthread_join(o->thread, NULL);
+		if (unlikely(err)) {
+			say(ERR, "sink: pthread_join: %s", strerror(err));
+			ret = false;
+		}
+
+		if (o->err)
+			ret = false;
+		if (!sink_close(o->sink))
+			ret = false;
+
+		pthread_cond_destroy(&o->drained);
+		pthread_cond_destroy(&o->filled);
+		pthread_mutex_destroy(&o->lock);
+		free(o->ring);
+	}
+
+	free(t);
+	return ret;
+}
+
+__attribute__((cold))
+static sink_t *tee_new(unsigned int nr;
+		const sink_type_t type[static nr],
+		unsigned int nr,
+		const char *name,
+		const int fd,
+		const unsigned int rate,
+		const unsigned int channels)
+{
+	/* a paced tee is handed a period at a time */
+	const size_t size = ((rt_period > rate * TEE_QUEUE_SECS)
+				? rt_period : rate * TEE_QUEUE_SECS)
+				* (size_t)channels;
+	struct tee *t;
+	unsigned int i;
+	sink_t *s;
+
+	s = calloc(1, sizeof(*s));
+	t = calloc(1, sizeof(*t) + nr * sizeof(t->out[0]));
+	if (s == NULL || t == NULL) {
+		say(ERR, "sink: out of memory");
+		goto out_free;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct tee_out * const o = &t->out[i];
+		int err;
+
+		o->size = size;
+		o->chunk = TEE_CHUNK * channels;
+		o->ring = malloc(size * sizeof(o->ring[0]));
+		if (o->ring == NULL) {
+			say(ERR, "sink: out of memory");
+			goto out_close;
+		}
+
+		pthread_mutex_init(&o->lock, NULL);
+		pthread_cond_init(&o->filled, NULL);
+		pthread_cond_init(&o->drained, NULL);
+
+		/* which has nothing to do until the sink's open */
+		err = pthread_create(&o->thread, NULL, teed, o);
+		if (err) {
+			say(ERR, "sink: pthread_create: %s", strerror(err));
+			pthread_cond_destroy(&o->drained);
+			pthread_cond_destroy(&o->filled);
+			pthread_mutex_destroy(&o->lock);
+			free(o->ring);
+			goto out_close;
+		}
+
+		o->sink = sink_new(type[i], name, fd, rate, channels);
+		if (o->sink == NULL) {
+			i++;
+			goto out_close;
+		}
+	}
+
+	t->nr = nr;
+	s->tee = t;
+	return s;
+
+out_close:
+	tee_close(t, i);
+	t = NULL;
+out_free:
+	free(t);
+	free(s);
+	return NULL;
+}
+
+sink_t *sink_new_tee(unsigned int nr;
+		const sink_type_t type[static nr],
+		unsigned int nr,
+		const char *name,
+		const int fd,
+		const unsigned int rate,
+		const unsigned int channels)
+{
+	sink_t *out;
+	sink_t *s;
+
+	out = (nr == 1)
+		? sink_new(type[0], name, fd, rate, channels)
+		: tee_new(type, nr, name, fd, rate, channels);
+	if (out == NULL || !rt_period)
+		return out;
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		say(ERR, "sink: out of memory");
+		goto out_close;
+	}
+
+	s->pacer = pacer_new(out, name, rate, channels, rt_period, rt_periods);
+	if (s->pacer == NULL)
+		goto out_free;
+
+	return s;
+
+out_free:
+	free(s);
+out_close:
+	/* nothing's been written, so there's nothing to lose */
+	if (!sink_close(out))
+		say(WARN, "%s: close failed", name);
+	return NULL;
+}
+
+__attribute__((nonnull(1),warn_unused_result))
+bool sink_write(size_t num;
+		sink_t *s,
+		const int16_t sample[static num],
+		size_t num)
+{
+	if (s->pacer != NULL)
+		return pacer_write_samples16(s->pacer, sample, num);
+	if (s->tee != NULL)
+		return tee_write(s->tee, sample, num);
+
+	switch (s->type) {
+	case SINK_WAV:
+		return wav_write_samples16(s->wav, sample, num);
+	case SINK_FLAC:
+		return flac_write_samples16(s->flac, sample, num);
+	case SINK_NPY:
+		return npy_write_samples16(s->npy, sample, num);
+	case SINK_RAW:
+		if (unlikely(!bufwr_write(s->raw, sample,
+						num * sizeof(sample[0])))) {
+			say(ERR, "sink: write: %s", strerror(errno));
+			return false;
+		}
+		return true;
+	case SINK_STATS:
+		stats_write_samples16(s->stats, sample, num);
+		return true;
+	case SINK_NULL:
+		return true;
+	default:
+		unreachable();
+	}
+}
+
+__attribute__((nonnull(1),warn_unused_result))
+bool sink_flush(sink_t *s)
+{
+	xassert(s->pacer == NULL);
+
+	if (s->tee != NULL)
+		return tee_flush(s->tee);
+
+	switch (s->type) {
+	case SINK_RAW:
+		if (unlikely(!bufwr_flush(s->raw))) {
+			say(ERR, "sink: write: %s", strerror(errno));
+			return false;
+		}
+		return true;
+	case SINK_WAV:
+	case SINK_FLAC:
+	case SINK_NPY:
+	case SINK_STATS:
+	case SINK_NULL:
+		return true;
+	default:
+		unreachable();
+	}
+}
+
+__attribute__((warn_unused_result))
+bool sink_close(sink_t *s)
+{
+	bool ret = true;
+
+	if (s == NULL)
+		return true;
+
+	if (s->pacer != NULL || s->tee != NULL) {
+		ret = (s->pacer != NULL) ? pacer_close(s->pacer)
+			: tee_close(s->tee, s->tee->nr);
+		free(s);
+		return ret;
+	}
+
+	switch (s->type) {
+	case SINK_WAV:
+		ret = wav_close(s->wav);
+		break;
+	case SINK_FLAC:
+		ret = flac_close(s->flac);
+		break;
+	case SINK_NPY:
+		ret = npy_close(s->npy);
+		break;
+	case SINK_RAW:
+		/* the fd is the caller's, and there may be more to come */
+		ret = bufwr_flush(s->raw);
+		if (!ret)
+			say(ERR, "sink: write: %s", strerror(errno));
+		bufwr__leak_fd(s->raw);
+		ret &= bufwr_close(s->raw, false);
+		break;
+	case SINK_STATS:
+		stats_close(s->stats);
+		break;
+	case SINK_NULL:
+		break;
+	default:
+		unreachable();
+	}
+
+	free(s);
+	return ret;
+}
@@ -0,0 +1,170 @@
+#include <spu-kit/spc-file.h>
+
+#include "system.h"
+
+#include <string.h>
+#include <endian.h>
+
+/* xid6 sub-chunk IDs, type 0 ones keep their value in the length field */
+#define XID6_INTRO	0x30
+#define XID6_LOOP	0x31
+#define XID6_END	0x32
+#define XID6_FADE	0x33
+#define XID6_LOOPS	0x35
+
+#define XID6_TYPE_DATA	0
+
+struct xid6_hdr {
+	uint8_t id[4];
+	uint32_t len;
+} __attribute__((packed));
+
+struct xid6_sub {
+	uint8_t id;
+	uint8_t type;
+	uint16_t len;
+} __attribute__((packed));
+
+/* Text fields are digits padded with NULs, whereas the binary ones are
+ * little-endian integers which, for any sensible length, have bytes which
+ * aren't digits.
+ */
+__attribute__((pure,nonnull(1)))
+bool id666_is_text(const struct spc_id666_txt *txt)
+{
+	const uint8_t *p = txt->song_secs;
+	const uint8_t * const end = txt->fade_msecs + sizeof(txt->fade_msecs);
+	bool digits = false;
+
+	for (; p < end; p++) {
+		if (*p >= '0' && *p <= '9') {
+			digits = true;
+		} else if (*p != '\0') {
+			return false;
+		}
+	}
+
+	return digits;
+}
+
+__attribute__((pure))
+static unsigned long text_number(size_t len;
+				const uint8_t str[static len],
+				size_t len)
+{
+	unsigned long val = 0;
+
+	for (size_t i = 0; i < len && str[i] >= '0' && str[i] <= '9'; i++) {
+		val = val * 10 + (str[i] - '0');
+	}
+
+	return val;
+}
+
+__attribute__((pure))
+static struct spc_length id666_length(const struct spc_file *spc)
+{
+	const struct spc_id666_txt * const txt = &spc->id666.txt;
+	const struct spc_id666_bin * const bin = &spc->id666.bin;
+	unsigned long secs, msecs;
+
+	if (spc->hdr.id666_tag_status != SPC_ID666_TAGGED)
+		return (struct spc_length){};
+
+	if (id666_is_text(txt)) {
+		secs = text_number(txt->song_secs, sizeof(txt->song_secs));
+		msecs = text_number(txt->fade_msecs, sizeof(txt->fade_msecs));
+	} else {
+		secs = bin->song_secs[0]
+			| (bin->song_secs[1] << 8)
+			| (bin->song_secs[2] << 16);
+		msecs = bin->fade_msecs[0]
+			| (bin->fade_msecs[1] << 8)
+			| (bin->fade_msecs[2] << 16)
+			| ((unsigned long)bin->fade_msecs[3] << 24);
+	}
+
+	return (struct spc_length){
+		.play = secs * SPC_TICKS_HZ,
+		.fade = msecs * (SPC_TICKS_HZ / 1000),
+	};
+}
+
+__attribute__((pure,nonnull(1)))
+struct spc_length spc_length(const struct spc_file *spc,
+				const uint8_t *xid6,
+				const size_t len)
+{
+	struct spc_length ret = id666_length(spc);
+	unsigned long intro = 0, loop = 0, loops = 1;
+	long end = 0;
+	bool have_intro = false;
+	struct xid6_hdr hdr;
+	size_t off, max;
+
+	if (len < sizeof(hdr))
+		return ret;
+
+	memcpy(&hdr, xid6, sizeof(hdr));
+	if (memcmp(hdr.id, SPC_XID6_ID, sizeof(hdr.id)))
+		return ret;
+
+	max = sizeof(hdr) + le32toh(hdr.len);
+	if (max > len)
+		max = len;
+
+	for (off = sizeof(hdr); off + sizeof(struct xid6_sub) <= max; ) {
+		struct xid6_sub sub;
+		uint32_t val;
+
+		memcpy(&sub, xid6 + off, sizeof(sub));
+		off += sizeof(sub);
+
+		if (sub.type == XID6_TYPE_DATA) {
+			val = le16toh(sub.len);
+		} else {
+			const size_t sz = le16toh(sub.len);
+
+			if (off + sz > max)
+				break;
+
+			val = 0;
+			if (sz == sizeof(val)) {
+				memcpy(&val, xid6 + off, sizeof(val));
+				val = le32toh(val);
+			}
+
+			/* sub-chunks are padded out to a multiple of 4 */
+			off += (sz + 3) & ~(size_t)3;
+		}
+
+		switch (sub.id) {
+		case XID6_INTRO:
+			intro = val;
+			have_intro = true;
+			break;
+		case XID6_LOOP:
+			loop = val;
+			break;
+		case XID6_END:
+			end = (int32_t)val;
+			break;
+		case XID6_FADE:
+			ret.fade = val;
+			break;
+		case XID6_LOOPS:
+			loops = val & 0xff;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (have_intro) {
+		const long play = intro + loop * loops + end;
+
+		ret.play = (play > 0) ? play : 0;
+	}
+
+	return ret;
+}
@@ -1,12 +1,18 @@
 #include <spu-kit/spc700.h>
+#include <spu-kit/spc-file.h>
 #include <spu-kit/dsp.h>
 
 #include "aram.h"
 #include "apu.h"
+#include "dsp.h"
 #include "system.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 /* Accuracy */
 // #define ACCURATE_SPC700
@@ -57,7 +63,11 @@ static bool overflow;
 static bool negative;
 
 /* RAM */
-uint8_t aram[0x10000];
+struct aram_pages aram_pages;
+
+static_assert(offsetof(struct spc_file, ram) == ARAM_LEAD, "ARAM lead");
+static_assert(sizeof(struct spc_file) > sizeof(aram_pages) - ARAM_PAGE,
+		"SPC file too short to back every page of ARAM");
 
 /* Mask ROM */
 static const uint8_t ipl_rom[0x40] = {
@@ -258,26 +268,40 @@ void _apu_set_show_ipl_rom(const bool show)
 
 	show_rom = show;
 
+	/* the echo buffer might be up there */
+	_dsp_aram_touch();
+
 	if (show_rom) {
 		memcpy(extra_ram, aram + IPL_ROM_BASE, IPL_ROM_SIZE);
 		memcpy(aram + IPL_ROM_BASE, ipl_rom, IPL_ROM_SIZE);
 	} else {
 		memcpy(aram + IPL_ROM_BASE, extra_ram, IPL_ROM_SIZE);
 	}
+
+	for (unsigned int i = 0; i < IPL_ROM_SIZE; i++) {
+		dsp_aram_written(IPL_ROM_BASE + i, aram[IPL_ROM_BASE + i]);
+	}
 }
 #endif
 
 static inline void mem_store(const uint16_t addr, const uint8_t byte)
 {
+	if (unlikely(dsp_aram_watched(addr))) {
+		_dsp_aram_touch();
+	}
 	if (apu_mmio_address(addr)) {
 		/* APU register stores are forwarded to RAM */
 		_apu_mmio_store(addr, byte);
 	}
 	aram[addr] = byte;
+	dsp_aram_written(addr, byte);
 }
 
 static inline uint8_t mem_load(const uint16_t addr)
 {
+	if (unlikely(dsp_aram_watched(addr))) {
+		_dsp_aram_touch();
+	}
 	if (apu_mmio_address(addr)) {
 		return _apu_mmio_load(addr);
 	}
@@ -324,6 +348,9 @@ static inline uint8_t fetch_insn(void)
 		return ipl_rom_load(addr);
 	}
 #endif
+	if (unlikely(dsp_aram_watched(pc))) {
+		_dsp_aram_touch();
+	}
 	return aram[pc++];
 #endif
 }
@@ -356,12 +383,40 @@ void spc700_restore(const struct spc700_regs r,
 			const uint8_t extra[static 0x40])
 {
 	set_regs(r);
-	memcpy(aram, in, sizeof(aram));
+	if (in != aram)
+		memcpy(aram, in, sizeof(aram));
 	memcpy(extra_ram, extra, sizeof(extra_ram));
 
 	dump_cpu_state();
 }
 
+__attribute__((cold))
+bool spc700_restore_file(const struct spc700_regs r,
+			const int fd,
+			const uint8_t extra[static 0x40])
+{
+	void *map;
+
+	if (sysconf(_SC_PAGESIZE) != ARAM_PAGE)
+		return false;
+
+	map = mmap(&aram_pages, sizeof(aram_pages), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED, fd, 0);
+	if (map == MAP_FAILED) {
+		say(WARN, "spc700: mmap: %s", strerror(errno));
+
+		/* which may have taken ARAM with it */
+		map = mmap(&aram_pages, sizeof(aram_pages),
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0);
+		xassert(map != MAP_FAILED);
+		return false;
+	}
+
+	spc700_restore(r, aram, extra);
+	return true;
+}
+
 __attribute__((cold))
 void spc700_reset(void)
 {
@@ -3639,7 +3694,7 @@ static void dtor(void)
 }
 
 __attribute__((hot,noinline))
-void spc700_run_forever(void)
+void spc700_run(void)
 {
 	unsigned int cycle = 0;
 
@@ -3667,6 +3722,8 @@ void spc700_run_forever(void)
 
 		if ((cycle & 0xf) == 0) {
 			_apu_update_clocks(cycle);
+			if (unlikely(dsp_done()))
+				return;
 		}
 	}
 }
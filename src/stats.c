@@ -0,0 +1,258 @@
+#include <spu-kit/stats.h>
+
+#include "system.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+
+/* BS.1770 gating blocks are 400 ms, overlapping by 75%, so they're built from
+ * 100 ms steps
+ */
+#define STEPS_PER_SEC	10
+#define STEPS_PER_BLOCK	4
+
+#define ABS_GATE	-70.0
+#define REL_GATE	-10.0
+
+struct biquad {
+	double b0, b1, b2, a1, a2;
+};
+
+struct kweight {
+	double z[2][2];
+};
+
+struct stats_s {
+	char *name;
+	unsigned int channels;
+
+	/* the K-weighting filter, a high shelf then a high pass */
+	struct biquad shelf;
+	struct biquad hpf;
+
+	uint64_t nr_frames;
+	unsigned int peak;
+	uint64_t nr_clipped;
+	double sum_sq;
+
+	/* K-weighted mean square of each whole step so far */
+	unsigned int step;
+	unsigned int step_pos;
+	double step_sq;
+	double *steps;
+	size_t nr_steps;
+	size_t max_steps;
+	bool oom;
+
+	struct kweight kw[];
+};
+
+/* Coefficients for any rate, rather than the 48 kHz ones in the
+ * recommendation, from the analogue prototypes they were derived from.
+ */
+static void kweight_init(stats_t *st, const unsigned int rate)
+{
+	double f0, g, q, k, vh, vb, a0;
+
+	f0 = 1681.974450955533;
+	g = 3.999843853973347;
+	q = 0.7071752369554196;
+	k = tan(M_PI * f0 / rate);
+	vh = pow(10.0, g / 20.0);
+	vb = pow(vh, 0.4996667741545416);
+	a0 = 1.0 + k / q + k * k;
+
+	st->shelf = (struct biquad){
+		.b0 = (vh + vb * k / q + k * k) / a0,
+		.b1 = 2.0 * (k * k - vh) / a0,
+		.b2 = (vh - vb * k / q + k * k) / a0,
+		.a1 = 2.0 * (k * k - 1.0) / a0,
+		.a2 = (1.0 - k / q + k * k) / a0,
+	};
+
+	f0 = 38.13547087602444;
+	q = 0.5003270373238773;
+	k = tan(M_PI * f0 / rate);
+	a0 = 1.0 + k / q + k * k;
+
+	st->hpf = (struct biquad){
+		.b0 = 1.0,
+		.b1 = -2.0,
+		.b2 = 1.0,
+		.a1 = 2.0 * (k * k - 1.0) / a0,
+		.a2 = (1.0 - k / q + k * k) / a0,
+	};
+}
+
+/* transposed direct form II */
+__attribute__((always_inline))
+static inline double biquad(const struct biquad *f, double z[static 2],
+				const double x)
+{
+	const double y = f->b0 * x + z[0];
+
+	z[0] = f->b1 * x - f->a1 * y + z[1];
+	z[1] = f->b2 * x - f->a2 * y;
+
+	return y;
+}
+
+stats_t *stats_new(const char *name,
+			const unsigned int rate,
+			const unsigned int channels)
+{
+	stats_t *st;
+
+	st = calloc(1, sizeof(*st) + channels * sizeof(st->kw[0]));
+	if (st == NULL) {
+		say(ERR, "stats: out of memory");
+		return NULL;
+	}
+
+	st->name = strdup(name);
+	if (st->name == NULL) {
+		say(ERR, "stats: out of memory");
+		free(st);
+		return NULL;
+	}
+
+	st->channels = channels;
+	st->step = rate / STEPS_PER_SEC;
+	kweight_init(st, rate);
+
+	return st;
+}
+
+static void end_step(stats_t *st)
+{
+	if (st->nr_steps == st->max_steps) {
+		const size_t max = (st->max_steps) ? st->max_steps * 2 : 1024;
+		double *steps;
+
+		steps = realloc(st->steps, max * sizeof(steps[0]));
+		if (steps == NULL) {
+			st->oom = true;
+			return;
+		}
+
+		st->steps = steps;
+		st->max_steps = max;
+	}
+
+	st->steps[st->nr_steps++] = st->step_sq / st->step;
+	st->step_sq = 0.0;
+	st->step_pos = 0;
+}
+
+__attribute__((nonnull(1)))
+void stats_write_samples16(size_t num;
+		stats_t *st,
+		const int16_t sample[static num],
+		size_t num)
+{
+	const unsigned int ch = st->channels;
+	const size_t frames = num / ch;
+
+	for (size_t i = 0; i < frames; i++) {
+		double sq = 0.0;
+
+		for (unsigned int c = 0; c < ch; c++) {
+			const int s = sample[i * ch + c];
+			const unsigned int mag = abs(s);
+			const double x = s * (1.0 / 32768.0);
+			double y;
+
+			if (mag > st->peak)
+				st->peak = mag;
+			if (s == INT16_MIN || s == INT16_MAX)
+				st->nr_clipped++;
+
+			st->sum_sq += x * x;
+
+			y = biquad(&st->shelf, st->kw[c].z[0], x);
+			y = biquad(&st->hpf, st->kw[c].z[1], y);
+			sq += y * y;
+		}
+
+		st->step_sq += sq;
+		if (++st->step_pos == st->step && !st->oom)
+			end_step(st);
+	}
+
+	st->nr_frames += frames;
+}
+
+/* The mean square of the blocks above gate, and how many of them there are */
+static double gated_mean(const stats_t *st, const double gate,
+				size_t *nr_blocks)
+{
+	double sum = 0.0;
+	size_t n = 0;
+
+	for (size_t i = STEPS_PER_BLOCK - 1; i < st->nr_steps; i++) {
+		double z = 0.0;
+
+		for (unsigned int j = 0; j < STEPS_PER_BLOCK; j++)
+			z += st->steps[i - j];
+		z /= STEPS_PER_BLOCK;
+
+		if (z > gate) {
+			sum += z;
+			n++;
+		}
+	}
+
+	*nr_blocks = n;
+	return (n) ? sum / n : 0.0;
+}
+
+__attribute__((const))
+static double to_lufs(const double z)
+{
+	return -0.691 + 10.0 * log10(z);
+}
+
+__attribute__((const))
+static double from_lufs(const double lufs)
+{
+	return pow(10.0, (lufs + 0.691) / 10.0);
+}
+
+/* -inf for silence, and for anything under 400 ms */
+static double loudness(const stats_t *st)
+{
+	double z;
+	size_t n;
+
+	z = gated_mean(st, from_lufs(ABS_GATE), &n);
+	if (!n)
+		return -INFINITY;
+
+	z = gated_mean(st, from_lufs(to_lufs(z) + REL_GATE), &n);
+	if (!n)
+		return -INFINITY;
+
+	return to_lufs(z);
+}
+
+__attribute__((nonnull(1)))
+void _stats_close(stats_t *st)
+{
+	const uint64_t nr = st->nr_frames * st->channels;
+	const double rms = (nr) ? sqrt(st->sum_sq / nr) : 0.0;
+
+	if (st->oom)
+		say(WARN, "%s: stats: out of memory, loudness is for the first "
+			"%zu ms", st->name, st->nr_steps * 1000 / STEPS_PER_SEC);
+
+	say(INFO, "%s: peak %.2f dBFS, RMS %.2f dBFS, %" PRIu64 " clipped, "
+		"loudness %.1f LUFS", st->name,
+		20.0 * log10(st->peak / 32768.0), 20.0 * log10(rms),
+		st->nr_clipped, loudness(st));
+
+	free(st->steps);
+	free(st->name);
+	free(st);
+}
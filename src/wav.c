@@ -1,8 +1,5 @@
 #include <spu-kit/wav.h>
-#include <spu-kit/bufwr.h>
 
-#include "bufwr.h"
-#include "fd.h"
 #include "system.h"
 
 #include <stdlib.h>
@@ -10,6 +7,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 
 typedef struct fourcc_s {
@@ -22,10 +20,19 @@ typedef struct fourcc_s {
 #define FOURCC(a, b, c, d) ((fourcc_t){ .bytes = {a, b, c, d}})
 
 #define RIFF FOURCC('R', 'I', 'F', 'F')
+#define RF64 FOURCC('R', 'F', '6', '4')
 #define WAVE FOURCC('W', 'A', 'V', 'E')
+#define JUNK FOURCC('J', 'U', 'N', 'K')
+#define DS64 FOURCC('d', 's', '6', '4')
 #define FMT FOURCC('f', 'm', 't', ' ')
 #define DATA FOURCC('d', 'a', 't', 'a')
 
+/* the RIFF and data sizes of an RF64 file, which live in the ds64 chunk */
+#define RF64_SIZE	UINT32_C(0xffffffff)
+
+/* The file is grown this much at a time, and mapped whole */
+#define EXTENT		(16UL << 20)
+
 struct chunk_hdr {
 	fourcc_t fourcc;
 	uint32_t size;
@@ -38,6 +45,18 @@ struct riff_hdr {
 };
 static_assert(sizeof(struct riff_hdr) == 12, "RIFF hdr size");
 
+/* Written as JUNK, and only turned in to ds64 if the file outgrows RIFF, so
+ * that the samples never have to move.
+ */
+struct ds64 {
+	struct chunk_hdr hdr;
+	uint64_t riff_size;
+	uint64_t data_size;
+	uint64_t sample_count;
+	uint32_t table_len;
+} __attribute__((packed));
+static_assert(sizeof(struct ds64) == 8 + 28, "ds64 chunk size");
+
 struct wave_fmt {
 	struct chunk_hdr hdr;
 	uint16_t audio_fmt;
@@ -51,38 +70,88 @@ static_assert(sizeof(struct wave_fmt) == 8 + 16, "wave fmt block size");
 
 struct wave_hdr {
 	struct riff_hdr riff;
+	struct ds64 ds64;
 	struct wave_fmt fmt;
 	struct chunk_hdr data;
 } __attribute__((packed));
 
+/* Samples are copied straight in to a shared mapping of the whole file, which
+ * is grown an extent at a time and cut back to size on close.
+ */
 struct wav_s {
-	struct bufwr buf;
+	int fd;
+	uint8_t *map;
+	size_t map_len;
 	size_t nr_samples;
+	struct wave_hdr hdr;
 };
 
-#define HZ 32000
-//#define HZ 33252
+/* the format is filled in by wav_create() */
 static const struct wave_hdr hdr = {
 	.riff = {
 		.hdr.fourcc = RIFF,
 		.form = WAVE,
 	},
+	.ds64 = {
+		.hdr.fourcc = JUNK,
+		.hdr.size = sizeof(struct ds64) - sizeof(struct chunk_hdr),
+	},
 	.fmt = {
 		.hdr.fourcc = FMT,
 		.hdr.size = 16,
 		.audio_fmt = 1,
-		.num_channels = 2,
-		.sample_rate = HZ ,
-		.byte_rate = HZ * 2 * 2,
 		.sample_bits = 16,
-		.block_align = 2,
 	},
 	.data = {
 		.fourcc = DATA,
 	},
 };
 
-wav_t *wav_create(const char *fn)
+/* Make the file, and the mapping of it, at least len bytes */
+__attribute__((nonnull(1),warn_unused_result))
+static bool grow(wav_t *wav, const size_t len)
+{
+	const size_t new_len = (len + EXTENT - 1) & ~(EXTENT - 1);
+	void *map;
+
+	if (likely(len <= wav->map_len))
+		return true;
+
+	/* Reserve the blocks up front so that running out of space is an
+	 * error here, rather than a SIGBUS on writing to the mapping.
+	 */
+	if (fallocate(wav->fd, 0, wav->map_len, new_len - wav->map_len)) {
+		if (errno != EOPNOTSUPP) {
+			say(ERR, "wav: fallocate: %s", strerror(errno));
+			return false;
+		}
+
+		if (ftruncate(wav->fd, new_len)) {
+			say(ERR, "wav: ftruncate: %s", strerror(errno));
+			return false;
+		}
+	}
+
+	if (wav->map == NULL) {
+		map = mmap(NULL, new_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+				wav->fd, 0);
+	} else {
+		map = mremap(wav->map, wav->map_len, new_len, MREMAP_MAYMOVE);
+	}
+
+	if (map == MAP_FAILED) {
+		say(ERR, "wav: mmap: %s", strerror(errno));
+		return false;
+	}
+
+	wav->map = map;
+	wav->map_len = new_len;
+	return true;
+}
+
+wav_t *wav_create(const char *fn,
+			const unsigned int rate,
+			const unsigned int channels)
 {
 	wav_t *wav;
 	int fd;
@@ -92,31 +161,33 @@ wav_t *wav_create(const char *fn)
 		goto out;
 	}
 
-	fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
 	if (fd < 0) {
 		say(ERR, "%s: open: %s", fn, strerror(errno));
 		goto out_free;
 	}
 
 	*wav = (struct wav_s) {
-		.buf = bufwr__init(fd, 0),
+		.fd = fd,
+		.hdr = hdr,
 	};
+	wav->hdr.fmt.num_channels = channels;
+	wav->hdr.fmt.sample_rate = rate;
+	wav->hdr.fmt.block_align = channels * 2;
+	wav->hdr.fmt.byte_rate = rate * channels * 2;
 
-	if (unlikely(wav->buf.buf == NULL))
+	if (unlikely(!grow(wav, sizeof(wav->hdr))))
 		goto out_close;
 
-	if (unlikely(!bufwr_write(&wav->buf, &hdr, sizeof(hdr))))
-		goto out_abort;
+	memcpy(wav->map, &wav->hdr, sizeof(wav->hdr));
 
 	return wav;
 
-out_abort:
-	bufwr__abort(&wav->buf);
-	goto out_free;
 out_close:
 	close(fd);
 out_free:
 	free(wav);
+	wav = NULL;
 out:
 	return wav;
 }
@@ -128,41 +199,66 @@ bool wav_write_samples16(size_t num;
 		size_t num)
 
 {
-	const bool ret = bufwr_write(&wav->buf, (uint8_t *)sample, num * sizeof(sample[0]));
+	const size_t off = sizeof(wav->hdr) + wav->nr_samples * sizeof(sample[0]);
+	const size_t len = num * sizeof(sample[0]);
 
-	if (unlikely(!ret)) {
-		say(ERR, "wav: write: %s", strerror(errno));
+	if (unlikely(!grow(wav, off + len)))
 		return false;
-	}
+
+	memcpy(wav->map + off, sample, len);
 
 	wav->nr_samples += num;
 
 	return true;
 }
 
-__attribute__((nonnull(1),warn_unused_result))
-static bool rewrite_hdr(wav_t *wav)
+/* Once the sizes no longer fit, the JUNK chunk becomes ds64 and the file RF64 */
+__attribute__((nonnull(1)))
+static void rewrite_hdr(wav_t *wav, const size_t file_size)
 {
-	const size_t file_size = (wav->nr_samples * 2) + sizeof(hdr);
-	struct wave_hdr fixed = hdr;
-
-	fixed.riff.hdr.size = file_size - sizeof(struct chunk_hdr);
-	fixed.data.size = file_size - sizeof(fixed);
+	const uint64_t riff_size = file_size - sizeof(struct chunk_hdr);
+	const uint64_t data_size = file_size - sizeof(hdr);
+	struct wave_hdr fixed = wav->hdr;
 
-	if (!fd_pwrite(wav->buf.fd, 0, (uint8_t *)&fixed, sizeof(fixed)))
-		return false;
+	if (riff_size > UINT32_MAX) {
+		fixed.riff.hdr.fourcc = RF64;
+		fixed.riff.hdr.size = RF64_SIZE;
+		fixed.ds64.hdr.fourcc = DS64;
+		fixed.ds64.riff_size = riff_size;
+		fixed.ds64.data_size = data_size;
+		fixed.ds64.sample_count = wav->nr_samples / fixed.fmt.num_channels;
+		fixed.data.size = RF64_SIZE;
+	} else {
+		fixed.riff.hdr.size = riff_size;
+		fixed.data.size = data_size;
+	}
 
-	return true;
+	memcpy(wav->map, &fixed, sizeof(fixed));
 }
 
 __attribute__((nonnull(1)))
 bool _wav_close(wav_t *wav)
 {
-	const bool ret = likely(
-		bufwr_flush(&wav->buf)
-		&& rewrite_hdr(wav)
-		&& bufwr__close(&wav->buf, false)
-	);
+	const size_t file_size = (wav->nr_samples * 2) + sizeof(hdr);
+	bool ret = true;
+
+	rewrite_hdr(wav, file_size);
+
+	if (unlikely(munmap(wav->map, wav->map_len))) {
+		say(ERR, "wav: munmap: %s", strerror(errno));
+		ret = false;
+	}
+
+	/* give back whatever's left of the last extent */
+	if (unlikely(ftruncate(wav->fd, file_size))) {
+		say(ERR, "wav: ftruncate: %s", strerror(errno));
+		ret = false;
+	}
+
+	if (unlikely(close(wav->fd))) {
+		say(ERR, "wav: close: %s", strerror(errno));
+		ret = false;
+	}
 
 	free(wav);
 	return ret;